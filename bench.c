@@ -0,0 +1,598 @@
+// Microbenchmarks for the simulation and the STATE encoders over synthetic,
+// seeded worlds. Prints one JSON object on stdout; every figure is per
+// operation. `make bench` builds this with malloc, calloc, realloc and
+// aligned_alloc renamed to the counters below in every file, so allocations
+// made inside the sim and the encoders are counted too.
+//
+// Every world is also probed with each collision kernel the CPU runs, and
+// the games of sim_step are replayed with their worms planned on several
+// threads. The bench exits 1 if a kernel finds a different set of
+// collisions than the scalar one, a threaded game ends differently, or the
+// chunks of a shot worm's path are not reused, or a worm slot reused after a
+// ghost plays differently from a fresh one. With --check (`make check`)
+// it runs only those checks and prints nothing but their failures.
+#define _DEFAULT_SOURCE // clock_gettime under -std=c11 on glibc
+#undef malloc
+#undef calloc
+#undef realloc
+#undef aligned_alloc
+
+#include "sim.h"
+#include "state.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN_BENCH_NS 200000000L // Keep doubling the op count until this long
+#define MAX_WORLD_POINTS 8000000L // Skip worlds larger than this in total
+#define STEP_GAME_TICKS 600       // sim_step runs whole 10 s games
+#define PROBES 1024               // Head positions check_collision cycles
+#define MAX_PLAN_THREADS 8        // Threads sim_step_threads plans on
+
+static unsigned long alloc_count = 0;
+static unsigned long alloc_bytes = 0;
+
+void *bench_malloc(size_t size) {
+  alloc_count++;
+  alloc_bytes += size;
+  return malloc(size);
+}
+
+void *bench_calloc(size_t count, size_t size) {
+  alloc_count++;
+  alloc_bytes += count * size;
+  return calloc(count, size);
+}
+
+void *bench_realloc(void *ptr, size_t size) {
+  alloc_count++;
+  alloc_bytes += size;
+  return realloc(ptr, size);
+}
+
+void *bench_aligned_alloc(size_t alignment, size_t size) {
+  alloc_count++;
+  alloc_bytes += size;
+  return aligned_alloc(alignment, size);
+}
+
+static long monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long)now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static uint32_t bench_rand(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+typedef struct {
+  const char *name;
+  int worms;
+  int path_points;
+  int ops_per_call; // Operations one call of the benchmark performs
+  long output_bytes; // Encoders only: size of one message
+  const char *kernel; // check_collision only: the segment kernel used
+  int threads;        // sim_step_threads only: threads planning the worms
+} BenchInfo;
+
+static bool first_result = true;
+static bool check_only = false; // --check: skip the measurements
+static volatile long sink; // Keeps results from being optimized away
+
+// Runs op until MIN_BENCH_NS has passed, doubling the call count each round
+// like Go's testing.B, and prints the last round as one JSON result.
+static void measure(BenchInfo info, long (*op)(void *), void *ctx) {
+  if (check_only) {
+    return;
+  }
+  long calls = 1;
+  long elapsed;
+  unsigned long allocs, bytes;
+  while (1) {
+    alloc_count = alloc_bytes = 0;
+    long start = monotonic_ns();
+    for (long i = 0; i < calls; i++) {
+      sink += op(ctx);
+    }
+    elapsed = monotonic_ns() - start;
+    allocs = alloc_count;
+    bytes = alloc_bytes;
+    if (elapsed >= MIN_BENCH_NS) {
+      break;
+    }
+    calls *= 2;
+  }
+
+  double ops = (double)calls * info.ops_per_call;
+  printf("%s\n    {\"name\": \"%s\", \"worms\": %d, \"path_points\": %d, "
+         "\"ops\": %.0f, \"ns_per_op\": %.1f, \"bytes_per_op\": %.1f, "
+         "\"allocs_per_op\": %.3f",
+         first_result ? "" : ",", info.name, info.worms, info.path_points,
+         ops, elapsed / ops, bytes / ops, allocs / ops);
+  if (info.output_bytes > 0) {
+    printf(", \"output_bytes\": %ld", info.output_bytes);
+  }
+  if (info.kernel != NULL) {
+    printf(", \"kernel\": \"%s\"", info.kernel);
+  }
+  if (info.threads > 0) {
+    printf(", \"threads\": %d", info.threads);
+  }
+  printf("}");
+  fflush(stdout);
+  first_result = false;
+}
+
+// Grows worm's path to exactly `points` points with a random walk that
+// turns for a while, then runs straight, like a player steering.
+static void grow_path(Sim *sim, Worm *worm, int points, uint32_t *rng) {
+  float turn = 0;
+  while (worm->path_length < points) {
+    if (bench_rand(rng) % 16 == 0) {
+      turn = TURN_SPEED * ((int)(bench_rand(rng) % 3) - 1);
+    }
+    worm->angle += turn;
+    Point next = {worm->position.x + cosf(worm->angle) * WORM_SPEED,
+                  worm->position.y + sinf(worm->angle) * WORM_SPEED};
+    next.x = fmodf(next.x + SCREEN_WIDTH, SCREEN_WIDTH);
+    next.y = fmodf(next.y + SCREEN_HEIGHT, SCREEN_HEIGHT);
+    worm->position = next;
+    addPointToPath(sim, worm, next);
+  }
+}
+
+// A sim holding `worms` worms spread over the screen, each with a path of
+// `points` points, at a tick where nobody is invincible any more.
+static void build_world(Sim *sim, int worms, int points, uint32_t seed) {
+  sim_init(sim, seed, DEFAULT_TICK_RATE);
+  uint32_t rng = seed;
+  for (int i = 0; i < worms; i++) {
+    float x = bench_rand(&rng) % SCREEN_WIDTH;
+    float y = bench_rand(&rng) % SCREEN_HEIGHT;
+    float angle = (bench_rand(&rng) % 628) / 100.0f;
+    initWorm(sim, &sim->worms[i], x, y, angle);
+    grow_path(sim, &sim->worms[i], points, &rng);
+  }
+  sim->num_worms = worms;
+  sim->current_tick = sim_seconds_to_ticks(sim, INVINCIIBILITY_TIME) + 1;
+}
+
+// Plans the worms of each tick on several threads, as a caller with a big
+// Sim would: thread t plans every threads-th worm from worm t, and the
+// thread stepping the sim applies the plans once all are done.
+typedef struct {
+  struct PlanPool *pool;
+  int index;
+  pthread_t thread;
+} PlanHelper;
+
+typedef struct PlanPool {
+  Sim *sim;
+  const uint8_t *inputs;
+  WormPlan plans[SIM_MAX_WORMS];
+  int threads; // Including the stepping one
+  PlanHelper helpers[MAX_PLAN_THREADS];
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  unsigned long round; // Bumped to start the helpers on a tick
+  int busy;            // Helpers not done with this round yet
+  bool quit;
+} PlanPool;
+
+static void plan_share(PlanPool *pool, int index) {
+  for (int i = index; i < pool->sim->num_worms; i += pool->threads) {
+    sim_plan_worm(pool->sim, i, pool->inputs[i], &pool->plans[i]);
+  }
+}
+
+static void *plan_helper(void *arg) {
+  PlanHelper *helper = arg;
+  PlanPool *pool = helper->pool;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&pool->mutex);
+  while (1) {
+    while (pool->round == seen && !pool->quit) {
+      pthread_cond_wait(&pool->start, &pool->mutex);
+    }
+    if (pool->quit) {
+      break;
+    }
+    seen = pool->round;
+    pthread_mutex_unlock(&pool->mutex);
+    plan_share(pool, helper->index);
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->busy == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+static void plan_pool_start(PlanPool *pool, int threads) {
+  memset(pool, 0, sizeof(*pool));
+  pool->threads = threads;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (int i = 1; i < threads; i++) {
+    pool->helpers[i].pool = pool;
+    pool->helpers[i].index = i;
+    pthread_create(&pool->helpers[i].thread, NULL, plan_helper,
+                   &pool->helpers[i]);
+  }
+}
+
+static void plan_pool_stop(PlanPool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+  for (int i = 1; i < pool->threads; i++) {
+    pthread_join(pool->helpers[i].thread, NULL);
+  }
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+}
+
+// sim_update_worms with the planning spread over the pool's threads
+static void plan_pool_update(PlanPool *pool, Sim *sim, const uint8_t *inputs) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->sim = sim;
+  pool->inputs = inputs;
+  pool->busy = pool->threads - 1;
+  pool->round++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+
+  plan_share(pool, 0);
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->busy > 0) {
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  sim_apply_plans(sim, pool->plans);
+}
+
+typedef struct {
+  int worms;
+  uint32_t seed;
+  Sim *reused;    // Played on after sim_reset, like a server's match; or NULL
+  PlanPool *pool; // Plans the worms on several threads; or NULL
+  uint32_t hash;  // sim_hash at the end of the last game
+} StepBench;
+
+// One whole game from the spawn: worms spread over the screen, steering
+// pseudo-randomly, colliding and dying as they would in play.
+static long step_op(void *arg) {
+  StepBench *bench = arg;
+  Sim fresh;
+  Sim *sim = bench->reused != NULL ? bench->reused : &fresh;
+  if (bench->reused != NULL) {
+    sim_reset(sim, bench->seed);
+  } else {
+    sim_init(sim, bench->seed, DEFAULT_TICK_RATE);
+  }
+  uint32_t rng = bench->seed;
+  for (int i = 0; i < bench->worms; i++) {
+    float x = bench_rand(&rng) % SCREEN_WIDTH;
+    float y = bench_rand(&rng) % SCREEN_HEIGHT;
+    initWorm(sim, &sim->worms[i], x, y, (bench_rand(&rng) % 628) / 100.0f);
+  }
+  sim->num_worms = bench->worms;
+
+  uint8_t inputs[SIM_MAX_WORMS];
+  for (int t = 0; t < STEP_GAME_TICKS; t++) {
+    for (int i = 0; i < bench->worms; i++) {
+      if (t % 20 == 0) {
+        inputs[i] = bench_rand(&rng) % 3; // Straight, left or right
+      }
+    }
+    if (bench->pool != NULL) {
+      sim_advance(sim);
+      plan_pool_update(bench->pool, sim, inputs);
+    } else {
+      sim_step(sim, inputs);
+    }
+  }
+
+  bench->hash = sim_hash(sim);
+  long alive = 0;
+  for (int i = 0; i < sim->num_worms; i++) {
+    alive += sim->worms[i].alive;
+  }
+  if (bench->reused == NULL) {
+    sim_free(sim);
+  }
+  return alive;
+}
+
+typedef struct {
+  Sim *sim;
+  Point from[PROBES];
+  Point to[PROBES];
+  int next;
+} CollisionBench;
+
+// The head of worm 0 sweeping one step from a random spot, against its own
+// tail and every other body
+static long collision_op(void *arg) {
+  CollisionBench *bench = arg;
+  int i = bench->next++ % PROBES;
+  return checkCollision(bench->sim, &bench->sim->worms[0], bench->from[i],
+                        bench->to[i]);
+}
+
+// Whether every kernel agrees with the scalar one on each probe, and on as
+// many more that start on a random point of a random body, where the
+// distances come closest to the hit radius
+static bool kernels_agree(CollisionBench *bench, uint32_t seed) {
+  Sim *sim = bench->sim;
+  uint32_t rng = seed;
+  bool agree = true;
+  for (int i = 0; i < 2 * PROBES && agree; i++) {
+    Point from = bench->from[i % PROBES], to = bench->to[i % PROBES];
+    if (i >= PROBES) {
+      Worm *worm = &sim->worms[bench_rand(&rng) % sim->num_worms];
+      Point p = sim_path_point(worm, bench_rand(&rng) % worm->path_length);
+      from = (Point){p.x + (int)(bench_rand(&rng) % 17) - 8,
+                     p.y + (int)(bench_rand(&rng) % 17) - 8};
+      to = (Point){from.x + to.x - bench->from[i % PROBES].x,
+                   from.y + to.y - bench->from[i % PROBES].y};
+    }
+    sim_use_kernel(SIM_KERNEL_SCALAR);
+    bool expected = checkCollision(sim, &sim->worms[0], from, to);
+    for (int k = 1; k < SIM_NUM_KERNELS; k++) {
+      if (sim_use_kernel(k) &&
+          checkCollision(sim, &sim->worms[0], from, to) != expected) {
+        fprintf(stderr, "Kernel %s disagrees with scalar at probe %d\n",
+                sim_kernel_name(k), i);
+        agree = false;
+      }
+    }
+  }
+  return agree;
+}
+
+// Whether the path of a worm killed by a bullet goes back to the arena: worm
+// 0 shoots worm 1 dead, then grows by as many chunks as worm 1 had, which
+// must all come off the free list. Both are ghosts so that no collision
+// kills either of them first.
+static bool shot_chunks_reused() {
+  Sim *sim = malloc(sizeof(Sim));
+  build_world(sim, 2, 10 * PATH_CHUNK_POINTS, 4242);
+  Worm *shooter = &sim->worms[0], *victim = &sim->worms[1];
+  uint8_t inputs[2] = {SIM_INPUT_UP, SIM_INPUT_UP}; // Keeps ghosts ghosts
+  for (int i = 0; i < 2; i++) {
+    sim->worms[i].is_ghost = true;
+    sim->worms[i].bullets_left = 0;
+    sim->worms[i].speed_boost_time_left = 0;
+  }
+  // Flies into where the victim's head moves this tick
+  float back = WORM_SPEED - BULLET_SPEED;
+  shooter->bullets[0] = (Bullet){
+      {victim->position.x + cosf(victim->angle) * back,
+       victim->position.y + sinf(victim->angle) * back},
+      victim->angle, true};
+  int victim_chunks = victim->num_chunks;
+  sim_update_worms(sim, inputs);
+
+  PathSlab *slab = sim->paths.current;
+  int carved = sim->paths.next_chunk;
+  uint32_t rng = 7;
+  grow_path(sim, shooter,
+            shooter->path_length + victim_chunks * PATH_CHUNK_POINTS, &rng);
+  bool reused = !victim->alive && victim->num_chunks == 0 &&
+                sim->paths.current == slab && sim->paths.next_chunk == carved;
+  if (!reused) {
+    fprintf(stderr, "A shot worm's path chunks were not reused\n");
+  }
+  sim_free(sim);
+  free(sim);
+  return reused;
+}
+
+// Whether a Sim reset after a game in which a worm ended as a ghost plays
+// the next game exactly as a fresh Sim does. Holding UP keeps a ghost a
+// ghost, so a flag left in the slot would show in the hash.
+static bool reused_slots_play_fresh() {
+  Sim *reused = malloc(sizeof(Sim));
+  Sim *fresh = malloc(sizeof(Sim));
+  uint8_t inputs[SIM_MAX_WORMS];
+  memset(inputs, SIM_INPUT_UP, sizeof(inputs));
+  sim_init(reused, 99, DEFAULT_TICK_RATE);
+  sim_add_worm(reused);
+  sim_add_worm(reused);
+  reused->worms[1].is_ghost = true;
+  sim_reset(reused, 4242);
+  sim_init(fresh, 4242, DEFAULT_TICK_RATE);
+
+  Sim *sims[2] = {reused, fresh};
+  for (int s = 0; s < 2; s++) {
+    sim_add_worm(sims[s]);
+    sim_add_worm(sims[s]);
+    for (int tick = 0; tick < STEP_GAME_TICKS; tick++) {
+      sim_step(sims[s], inputs);
+    }
+  }
+  bool same = sim_hash(reused) == sim_hash(fresh);
+  if (!same) {
+    fprintf(stderr,
+            "A reused worm slot played differently from a fresh one\n");
+  }
+  sim_free(reused);
+  sim_free(fresh);
+  free(reused);
+  free(fresh);
+  return same;
+}
+
+typedef struct {
+  WorldState world;
+  int path_starts[SIM_MAX_WORMS];
+  bool text;
+  char *buffer;
+  size_t size;
+} EncodeBench;
+
+static long encode_op(void *arg) {
+  EncodeBench *bench = arg;
+  return bench->text ? build_text_state(&bench->world, bench->buffer,
+                                        bench->size, bench->path_starts)
+                     : build_binary_state(&bench->world, bench->buffer,
+                                          bench->size, bench->path_starts);
+}
+
+static void bench_encoders(Sim *sim, int worms, int points) {
+  EncodeBench *bench = calloc(1, sizeof(EncodeBench));
+  Point *paths = malloc((size_t)worms * points * sizeof(Point));
+  bench->world.seq = 1;
+  bench->world.num_worms = worms;
+  for (int i = 0; i < worms; i++) {
+    Worm *worm = &sim->worms[i];
+    WormSnapshot *copy = &bench->world.worms[i];
+    copy->position = worm->position;
+    copy->angle = worm->angle;
+    copy->alive = worm->alive;
+    copy->path_length = worm->path_length;
+    copy->path_base = 0;
+    copy->points = paths + (size_t)i * points;
+    sim_copy_path(worm, 0, worm->path_length, copy->points);
+  }
+  bench->size = (size_t)worms * points * 16 + 4096; // Text is the larger
+  bench->buffer = malloc(bench->size);
+
+  static const char *names[2][2] = {
+      {"encode_binary_full", "encode_binary_delta"},
+      {"encode_text_full", "encode_text_delta"}};
+  for (int text = 0; text < 2; text++) {
+    for (int delta = 0; delta < 2; delta++) {
+      // A delta resends the last acknowledged point and adds one new one
+      for (int i = 0; i < worms; i++) {
+        bench->path_starts[i] = delta ? points - 2 : 0;
+      }
+      bench->text = text;
+      BenchInfo info = {names[text][delta], worms, points, 1,
+                        encode_op(bench), NULL, 0};
+      measure(info, encode_op, bench);
+    }
+  }
+  free(bench->buffer);
+  free(paths);
+  free(bench);
+}
+
+int main(int argc, char *argv[]) {
+  check_only = argc > 1 && strcmp(argv[1], "--check") == 0;
+  static const int worm_counts[] = {2, 6, 64};
+  static const int path_points[] = {100, 10000, 1000000};
+  const int num_worm_counts = sizeof(worm_counts) / sizeof(worm_counts[0]);
+  const int num_path_points = sizeof(path_points) / sizeof(path_points[0]);
+
+  bool agree = shot_chunks_reused();
+  agree = reused_slots_play_fresh() && agree;
+  if (!check_only) {
+    printf("{\n  \"benchmarks\": [");
+  }
+
+  for (int w = 0; w < num_worm_counts; w++) {
+    StepBench step = {worm_counts[w], 12345, NULL, NULL, 0};
+    BenchInfo info = {"sim_step", worm_counts[w], 0, STEP_GAME_TICKS, 0,
+                      NULL, 0};
+    measure(info, step_op, &step);
+  }
+
+  // The same games on one Sim, whose memory earlier games left behind
+  for (int w = 0; w < num_worm_counts; w++) {
+    Sim *sim = malloc(sizeof(Sim));
+    sim_init(sim, 12345, DEFAULT_TICK_RATE);
+    StepBench step = {worm_counts[w], 12345, sim, NULL, 0};
+    BenchInfo info = {"sim_step_reused", worm_counts[w], 0, STEP_GAME_TICKS,
+                      0, NULL, 0};
+    measure(info, step_op, &step);
+    sim_free(sim);
+    free(sim);
+  }
+
+  // The same games again with the worms planned on a thread per CPU (at
+  // least two), which must end exactly as the single-threaded ones do
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cpus < 2 ? 2 : (cpus > MAX_PLAN_THREADS ? MAX_PLAN_THREADS
+                                                        : (int)cpus);
+  PlanPool *pool = malloc(sizeof(PlanPool));
+  plan_pool_start(pool, threads);
+  for (int w = 0; w < num_worm_counts; w++) {
+    StepBench serial = {worm_counts[w], 12345, NULL, NULL, 0};
+    StepBench step = {worm_counts[w], 12345, NULL, pool, 0};
+    step_op(&serial);
+    step_op(&step);
+    if (step.hash != serial.hash) {
+      fprintf(stderr, "Planning on %d threads changed the game of %d worms\n",
+              threads, worm_counts[w]);
+      agree = false;
+    }
+    BenchInfo info = {"sim_step_threads", worm_counts[w], 0, STEP_GAME_TICKS,
+                      0, NULL, threads};
+    measure(info, step_op, &step);
+  }
+  plan_pool_stop(pool);
+  free(pool);
+
+  for (int w = 0; w < num_worm_counts; w++) {
+    for (int p = 0; p < num_path_points; p++) {
+      int worms = worm_counts[w];
+      int points = path_points[p];
+      if ((long)worms * points > MAX_WORLD_POINTS) {
+        continue;
+      }
+
+      Sim *sim = malloc(sizeof(Sim));
+      build_world(sim, worms, points, 777);
+
+      CollisionBench *collision = malloc(sizeof(CollisionBench));
+      collision->sim = sim;
+      collision->next = 0;
+      uint32_t rng = 99;
+      for (int i = 0; i < PROBES; i++) {
+        Point from = {bench_rand(&rng) % SCREEN_WIDTH,
+                      bench_rand(&rng) % SCREEN_HEIGHT};
+        float angle = (bench_rand(&rng) % 628) / 100.0f;
+        collision->from[i] = from;
+        collision->to[i] = (Point){from.x + cosf(angle) * WORM_SPEED,
+                                   from.y + sinf(angle) * WORM_SPEED};
+      }
+      agree = kernels_agree(collision, 31) && agree;
+      for (int k = 0; k < SIM_NUM_KERNELS; k++) {
+        if (sim_use_kernel(k)) {
+          BenchInfo info = {"check_collision", worms, points, 1, 0,
+                            sim_kernel_name(k), 0};
+          measure(info, collision_op, collision);
+        }
+      }
+      free(collision);
+
+      if (!check_only) {
+        bench_encoders(sim, worms, points);
+      }
+      sim_free(sim);
+      free(sim);
+    }
+  }
+
+  if (!check_only) {
+    printf("\n  ]\n}\n");
+  }
+  return agree ? 0 : 1;
+}
@@ -1,10 +1,16 @@
 #include <SDL.h>
 #include <SDL_ttf.h>
+#include "log.h"
+#include "protocol.h"
+#include "sim.h"
 #include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,18 +18,10 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
-#define MAX_WORMS 6
-#define SCREEN_WIDTH (int)(1024 * 1.2)
-#define SCREEN_HEIGHT (int)(640 * 1.2)
-#define WORM_SPEED 2.0
-#define TURN_SPEED 0.1
-#define WORM_RADIUS 3
+#define MAX_WORMS SIM_MAX_WORMS
 #define INPUT_BUFFER_SIZE 10
-#define MAX_BULLETS 3
-#define BULLET_RADIUS 5
-#define MAX_POWERUPS 3
-#define POWERUP_RADIUS 10
 #define CLIENT_TICK_RATE 60 // Hz
+#define SERVER_RECV_BUFFER_SIZE (64 * 1024)
 
 #define MAX_SERVERS 10
 #define DISCOVERY_PORT 8081
@@ -32,17 +30,6 @@
 #define MAX_PLAYERS 6
 #define MAX_NAME_LENGTH 20
 
-typedef struct {
-  float x;
-  float y;
-} Point;
-
-typedef struct {
-  Point position;
-  float angle;
-  bool active;
-} Bullet;
-
 typedef struct {
   int id;
   char name[MAX_NAME_LENGTH];
@@ -60,13 +47,7 @@ typedef struct {
   bool up;
 } InputState;
 
-typedef enum { POWERUP_BULLETS, POWERUP_SPEED, POWERUP_GHOST } PowerupType;
-
-typedef struct {
-  Point position;
-  PowerupType type;
-} Powerup;
-
+// A worm as the last STATE described it
 typedef struct {
   Point position;
   float angle;
@@ -80,21 +61,91 @@ typedef struct {
   float speed_boost_time_left;
   bool speed_boost_active;
   bool is_ghost;
-} Worm;
+  uint32_t input_seq; // Our INPUT the server's tick applied, for player_id
+} RemoteWorm;
+
+#define MAX_PENDING_INPUTS 64        // About a second of inputs in flight
+#define PREDICTION_DECAY 0.8f        // Share of the offset left per frame
+#define PREDICTION_SNAP_DISTANCE 40  // Further off than this (px), jump
+
+// Everything a frame draws: the worms and powerups of one complete STATE,
+// our prediction on top of it, and what changed on the canvas since the
+// view published before it.
+typedef struct {
+  int num_worms;
+  RemoteWorm worms[MAX_WORMS];
+  int num_powerups;
+  Powerup powerups[MAX_POWERUPS];
+  int player_id;
+  Point predicted_path[MAX_PENDING_INPUTS];
+  int predicted_length;
+  Point prediction_offset; // As of prediction_offset_time, fading since
+  Uint32 prediction_offset_time;
+  bool canvas_dirty;             // Pixels must go: clear, redraw every trail
+  int redraw_from[MAX_WORMS];    // Lowest point rewritten, INT_MAX if none
+} WorldView;
+
+// The network threads decode into `decoded`, which only they touch (under
+// state_mutex), and publish it through a triple buffer: they copy it into
+// views[view_back] and swap that into view_ready. The render loop swaps
+// view_ready for its views[view_front] when VIEW_FRESH is set, so it
+// always draws a complete STATE and neither side waits for the other.
+#define VIEW_FRESH 4 // Set in view_ready until the render loop takes it
+WorldView decoded;
+WorldView views[3];
+int view_back = 0;
+_Atomic int view_ready = 1;
+int view_front = 2;
+int synced_length[3][MAX_WORMS]; // Points of views[v] that match decoded
+
+// Canvas changes found while decoding and not yet published, and those
+// published in a view the render loop may not have taken yet
+bool pending_canvas_dirty = false;
+int pending_redraw_from[MAX_WORMS];
+bool published_canvas_dirty = false;
+int published_redraw_from[MAX_WORMS];
 
-Worm worms[MAX_WORMS];
-int num_worms = 0;
 int sock = 0;
 bool game_started = false;
 int player_id = -1;
 Uint32 game_start_time = 0;
-Powerup powerups[MAX_POWERUPS];
-int num_powerups = 0;
 
+// The trails, rasterized once as their points arrive. Only the render loop
+// touches these.
 SDL_Texture *canvas_texture = NULL;
+bool canvas_lost = true;       // Cleared and drawn in full on the next frame
+int drawn_length[MAX_WORMS];   // Points whose segments are in canvas_texture
 
 InputState current_input = {false, false, false};
 pthread_mutex_t input_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// UDP channel for INPUT and STATE, opened once the server sends UDP_TOKEN
+int udp_sock = -1;
+uint32_t udp_connection_id = 0;
+uint64_t udp_nonce = 0;
+uint32_t input_seq = 0;
+unsigned int ack_seq = 0;        // Rides along with every UDP INPUT
+unsigned int last_state_seq = 0; // Snapshots at or below this are stale
+pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Client-side prediction of our own worm, guarded by state_mutex. Each input
+// sent is kept under its sequence number until a STATE reports it applied.
+// The head we draw is the server's head with the inputs still in flight
+// replayed on top by the sim's movement rules. When a STATE disagrees with
+// the prediction, the difference is drawn as an offset that fades out over
+// a few frames rather than as a jump.
+uint8_t pending_inputs[MAX_PENDING_INPUTS]; // Indexed by seq % the size
+uint32_t predicted_seq = 0;                 // Newest input predicted
+Point predicted_path[MAX_PENDING_INPUTS];   // Head after each input in flight
+int predicted_length = 0;
+float predicted_angle = 0;
+float predicted_boost_time = 0;
+// The server's simulation rate, from TICK_RATE. Inputs go out at this rate
+// so that each one predicts one server tick.
+_Atomic int server_tick_rate = DEFAULT_TICK_RATE;
+Point prediction_offset = {0, 0};
+Uint32 prediction_offset_time = 0;
 
 SDL_Color colors[MAX_WORMS] = {
     {239, 71, 111, 255}, {247, 140, 107, 255}, {255, 209, 102, 255},
@@ -119,6 +170,95 @@ Player players[MAX_PLAYERS];
 int num_players = 0;
 bool waiting_for_game_start = true;
 
+// Rendered strings, kept as textures so that screens drawn every frame do
+// not rasterize and upload their text every time. Entries are keyed by
+// (text, color, style); when the cache is full the least recently used one
+// is replaced, so text that stopped being drawn ages out.
+#define TEXT_CACHE_SIZE 32
+#define TEXT_CACHE_KEY_SIZE 128 // Longer text is cut
+
+typedef enum { TEXT_BLENDED, TEXT_SOLID } TextStyle;
+
+typedef struct {
+  char text[TEXT_CACHE_KEY_SIZE];
+  SDL_Color color;
+  TextStyle style;
+  SDL_Texture *texture; // NULL if the entry is free
+  int w, h;
+  unsigned long last_used; // 0 if the entry is free
+} CachedText;
+
+CachedText text_cache[TEXT_CACHE_SIZE];
+unsigned long text_cache_clock = 0;
+
+// Returns text as rendered in font, or NULL if rendering it failed
+CachedText *get_text(SDL_Renderer *renderer, const char *text,
+                     SDL_Color color, TextStyle style) {
+  CachedText *slot = &text_cache[0];
+  for (int i = 0; i < TEXT_CACHE_SIZE; i++) {
+    CachedText *entry = &text_cache[i];
+    if (entry->texture != NULL && entry->style == style &&
+        memcmp(&entry->color, &color, sizeof(color)) == 0 &&
+        strncmp(entry->text, text, TEXT_CACHE_KEY_SIZE - 1) == 0) {
+      entry->last_used = ++text_cache_clock;
+      return entry;
+    }
+    if (entry->last_used < slot->last_used) {
+      slot = entry;
+    }
+  }
+
+  if (slot->texture != NULL) {
+    SDL_DestroyTexture(slot->texture);
+    slot->texture = NULL;
+    slot->last_used = 0;
+  }
+  snprintf(slot->text, sizeof(slot->text), "%s", text);
+  SDL_Surface *surface = style == TEXT_SOLID
+                             ? TTF_RenderText_Solid(font, slot->text, color)
+                             : TTF_RenderText_Blended(font, slot->text, color);
+  if (surface == NULL) {
+    log_error("Unable to render text surface! SDL_ttf Error: %s",
+              TTF_GetError());
+    return NULL;
+  }
+
+  slot->texture = SDL_CreateTextureFromSurface(renderer, surface);
+  slot->w = surface->w;
+  slot->h = surface->h;
+  SDL_FreeSurface(surface);
+  if (slot->texture == NULL) {
+    log_error("Unable to create texture from rendered text! SDL Error: %s",
+              SDL_GetError());
+    return NULL;
+  }
+  slot->color = color;
+  slot->style = style;
+  slot->last_used = ++text_cache_clock;
+  return slot;
+}
+
+void free_text_cache() {
+  for (int i = 0; i < TEXT_CACHE_SIZE; i++) {
+    if (text_cache[i].texture != NULL) {
+      SDL_DestroyTexture(text_cache[i].texture);
+    }
+  }
+  memset(text_cache, 0, sizeof(text_cache));
+}
+
+// Draws text with its top edge at y, centered on the screen
+void draw_centered_text(SDL_Renderer *renderer, const char *text, int y,
+                        SDL_Color color) {
+  CachedText *rendered = get_text(renderer, text, color, TEXT_BLENDED);
+  if (rendered == NULL) {
+    return;
+  }
+  SDL_Rect rect = {SCREEN_WIDTH / 2 - rendered->w / 2, y, rendered->w,
+                   rendered->h};
+  SDL_RenderCopy(renderer, rendered->texture, NULL, &rect);
+}
+
 void draw_waiting_screen(SDL_Renderer *renderer) {
   SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
   SDL_RenderClear(renderer);
@@ -126,43 +266,19 @@ void draw_waiting_screen(SDL_Renderer *renderer) {
   SDL_Color text_color = {255, 255, 255, 255};
 
   // Render title
-  SDL_Surface *title_surface =
-      TTF_RenderText_Blended(font, "Waiting for players...", text_color);
-  SDL_Texture *title_texture =
-      SDL_CreateTextureFromSurface(renderer, title_surface);
-  SDL_Rect title_rect = {SCREEN_WIDTH / 2 - title_surface->w / 2, 50,
-                         title_surface->w, title_surface->h};
-  SDL_RenderCopy(renderer, title_texture, NULL, &title_rect);
-  SDL_FreeSurface(title_surface);
-  SDL_DestroyTexture(title_texture);
+  draw_centered_text(renderer, "Waiting for players...", 50, text_color);
 
   // Render player list
   for (int i = 0; i < num_players; i++) {
     char player_text[MAX_NAME_LENGTH + 10];
     snprintf(player_text, sizeof(player_text), "Player %d: %s", players[i].id,
              players[i].name);
-    SDL_Surface *player_surface =
-        TTF_RenderText_Blended(font, player_text, text_color);
-    SDL_Texture *player_texture =
-        SDL_CreateTextureFromSurface(renderer, player_surface);
-    SDL_Rect player_rect = {SCREEN_WIDTH / 2 - player_surface->w / 2,
-                            150 + i * 40, player_surface->w, player_surface->h};
-    SDL_RenderCopy(renderer, player_texture, NULL, &player_rect);
-    SDL_FreeSurface(player_surface);
-    SDL_DestroyTexture(player_texture);
+    draw_centered_text(renderer, player_text, 150 + i * 40, text_color);
   }
 
   // Render "Press space to play" message
-  SDL_Surface *space_surface =
-      TTF_RenderText_Blended(font, "Press space to play", text_color);
-  SDL_Texture *space_texture =
-      SDL_CreateTextureFromSurface(renderer, space_surface);
-  SDL_Rect space_rect = {SCREEN_WIDTH / 2 - space_surface->w / 2,
-                         SCREEN_HEIGHT - 100, space_surface->w,
-                         space_surface->h};
-  SDL_RenderCopy(renderer, space_texture, NULL, &space_rect);
-  SDL_FreeSurface(space_surface);
-  SDL_DestroyTexture(space_texture);
+  draw_centered_text(renderer, "Press space to play", SCREEN_HEIGHT - 100,
+                     text_color);
 
   SDL_RenderPresent(renderer);
 }
@@ -201,29 +317,16 @@ void draw_button(SDL_Renderer *renderer, Button *button) {
 
   // Render text
   SDL_Color text_color = {255, 255, 255, 255}; // White text
-  SDL_Surface *surface = TTF_RenderText_Blended(font, button->text, text_color);
-  if (surface == NULL) {
-    printf("Unable to render text surface! SDL_ttf Error: %s\n",
-           TTF_GetError());
+  CachedText *text = get_text(renderer, button->text, text_color, TEXT_BLENDED);
+  if (text == NULL) {
     return;
   }
 
-  SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-  if (texture == NULL) {
-    printf("Unable to create texture from rendered text! SDL Error: %s\n",
-           SDL_GetError());
-    SDL_FreeSurface(surface);
-    return;
-  }
-
-  SDL_Rect text_rect = {button->rect.x + (button->rect.w - surface->w) / 2,
-                        button->rect.y + (button->rect.h - surface->h) / 2,
-                        surface->w, surface->h};
-
-  SDL_RenderCopy(renderer, texture, NULL, &text_rect);
+  SDL_Rect text_rect = {button->rect.x + (button->rect.w - text->w) / 2,
+                        button->rect.y + (button->rect.h - text->h) / 2,
+                        text->w, text->h};
 
-  SDL_FreeSurface(surface);
-  SDL_DestroyTexture(texture);
+  SDL_RenderCopy(renderer, text->texture, NULL, &text_rect);
 }
 
 void draw_home_screen(SDL_Renderer *renderer) {
@@ -233,30 +336,16 @@ void draw_home_screen(SDL_Renderer *renderer) {
 
   // Draw title
   SDL_Color title_color = {255, 255, 255, 255}; // White color
-  SDL_Surface *title_surface =
-      TTF_RenderText_Blended(font, "Battle Noodles", title_color);
-  if (title_surface == NULL) {
-    printf("Unable to render title surface! SDL_ttf Error: %s\n",
-           TTF_GetError());
-    return;
-  }
-
-  SDL_Texture *title_texture =
-      SDL_CreateTextureFromSurface(renderer, title_surface);
-  if (title_texture == NULL) {
-    printf("Unable to create texture from rendered title! SDL Error: %s\n",
-           SDL_GetError());
-    SDL_FreeSurface(title_surface);
+  CachedText *title =
+      get_text(renderer, "Battle Noodles", title_color, TEXT_BLENDED);
+  if (title == NULL) {
     return;
   }
 
-  SDL_Rect title_rect = {(SCREEN_WIDTH - title_surface->w) / 2, 50,
-                         title_surface->w, title_surface->h};
+  SDL_Rect title_rect = {(SCREEN_WIDTH - title->w) / 2, 50, title->w,
+                         title->h};
 
-  SDL_RenderCopy(renderer, title_texture, NULL, &title_rect);
-
-  SDL_FreeSurface(title_surface);
-  SDL_DestroyTexture(title_texture);
+  SDL_RenderCopy(renderer, title->texture, NULL, &title_rect);
 
   // Draw buttons
   draw_button(renderer, &host_button);
@@ -270,39 +359,26 @@ bool is_point_in_rect(int x, int y, SDL_Rect *rect) {
 
 void render_text(SDL_Renderer *renderer, const char *text, int x, int y,
                  SDL_Color color) {
-  SDL_Surface *surface = TTF_RenderText_Solid(font, text, color);
-  if (surface == NULL) {
-    printf("Unable to render text surface! SDL_ttf Error: %s\n",
-           TTF_GetError());
+  CachedText *rendered = get_text(renderer, text, color, TEXT_SOLID);
+  if (rendered == NULL) {
     return;
   }
 
-  SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-  if (texture == NULL) {
-    printf("Unable to create texture from rendered text! SDL Error: %s\n",
-           SDL_GetError());
-    SDL_FreeSurface(surface);
-    return;
-  }
-
-  SDL_Rect dest = {x, y, surface->w, surface->h};
-  SDL_RenderCopy(renderer, texture, NULL, &dest);
-
-  SDL_FreeSurface(surface);
-  SDL_DestroyTexture(texture);
+  SDL_Rect dest = {x, y, rendered->w, rendered->h};
+  SDL_RenderCopy(renderer, rendered->texture, NULL, &dest);
 }
 
 void discover_servers() {
   int sock = socket(AF_INET, SOCK_DGRAM, 0);
   if (sock < 0) {
-    perror("Socket creation failed");
+    log_error("Socket creation failed: %s", strerror(errno));
     return;
   }
 
   int broadcast = 1;
   if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &broadcast,
                  sizeof(broadcast)) < 0) {
-    perror("Set socket option failed");
+    log_error("Set socket option failed: %s", strerror(errno));
     close(sock);
     return;
   }
@@ -316,7 +392,7 @@ void discover_servers() {
   char discovery_message[] = "DISCOVER_BATTLE_NOODLES_SERVER";
   if (sendto(sock, discovery_message, strlen(discovery_message), 0,
              (struct sockaddr *)&broadcast_addr, sizeof(broadcast_addr)) < 0) {
-    perror("Broadcast failed");
+    log_error("Broadcast failed: %s", strerror(errno));
     close(sock);
     return;
   }
@@ -325,7 +401,7 @@ void discover_servers() {
   tv.tv_sec = SERVER_RESPONSE_TIMEOUT;
   tv.tv_usec = 0;
   if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-    perror("Set socket timeout failed");
+    log_error("Set socket timeout failed: %s", strerror(errno));
     close(sock);
     return;
   }
@@ -342,7 +418,7 @@ void discover_servers() {
         // Timeout reached, no more servers responding
         break;
       }
-      perror("Receive failed");
+      log_error("Receive failed: %s", strerror(errno));
       continue;
     }
 
@@ -404,309 +480,944 @@ int choose_server(SDL_Renderer *renderer) {
   }
 }
 
-void drawCircle(SDL_Renderer *renderer, int x, int y, int radius) {
-  for (int w = 0; w < radius * 2; w++) {
-    for (int h = 0; h < radius * 2; h++) {
-      int dx = radius - w;
-      int dy = radius - h;
-      if ((dx * dx + dy * dy) <= (radius * radius)) {
-        SDL_RenderDrawPoint(renderer, x + dx, y + dy);
-      }
+// Triangles for one SDL_RenderGeometry call. Every vertex carries its
+// shape's color, so shapes of any color share a call. The arrays are kept
+// between frames and only grow.
+typedef struct {
+  SDL_Vertex *vertices;
+  int count;
+  int capacity;
+} GeometryBatch;
+
+#define CIRCLE_SEGMENTS 16 // Triangles in a disc
+
+GeometryBatch trail_batch;   // Segments going into canvas_texture
+GeometryBatch overlay_batch; // Drawn over the canvas every frame
+SDL_FPoint circle_points[CIRCLE_SEGMENTS + 1]; // Unit circle, last = first
+
+// Makes room for count more vertices. Returns false if that failed.
+bool reserveBatch(GeometryBatch *batch, int count) {
+  if (batch->count + count <= batch->capacity) {
+    return true;
+  }
+  int capacity = batch->capacity ? batch->capacity : 1024;
+  while (capacity < batch->count + count) {
+    capacity *= 2;
+  }
+  SDL_Vertex *vertices =
+      realloc(batch->vertices, capacity * sizeof(SDL_Vertex));
+  if (vertices == NULL) {
+    return false;
+  }
+  batch->vertices = vertices;
+  batch->capacity = capacity;
+  return true;
+}
+
+void addVertex(GeometryBatch *batch, float x, float y, SDL_Color color) {
+  SDL_Vertex *vertex = &batch->vertices[batch->count++];
+  vertex->position.x = x;
+  vertex->position.y = y;
+  vertex->color = color;
+  vertex->tex_coord.x = 0;
+  vertex->tex_coord.y = 0;
+}
+
+// A filled disc, as a fan of CIRCLE_SEGMENTS triangles around its center
+void batchCircle(GeometryBatch *batch, float x, float y, float radius,
+                 SDL_Color color) {
+  if (circle_points[0].x == 0) {
+    for (int i = 0; i <= CIRCLE_SEGMENTS; i++) {
+      float angle = 2 * PI * (i % CIRCLE_SEGMENTS) / CIRCLE_SEGMENTS;
+      circle_points[i].x = cosf(angle);
+      circle_points[i].y = sinf(angle);
     }
   }
+  if (!reserveBatch(batch, CIRCLE_SEGMENTS * 3)) {
+    return;
+  }
+  for (int i = 0; i < CIRCLE_SEGMENTS; i++) {
+    addVertex(batch, x, y, color);
+    addVertex(batch, x + circle_points[i].x * radius,
+              y + circle_points[i].y * radius, color);
+    addVertex(batch, x + circle_points[i + 1].x * radius,
+              y + circle_points[i + 1].y * radius, color);
+  }
 }
 
-void drawThickLine(SDL_Renderer *renderer, int x1, int y1, int x2, int y2) {
-  int deltaX = abs(x2 - x1);
-  int deltaY = abs(y2 - y1);
-  if (deltaX > SCREEN_WIDTH / 2 || deltaY > SCREEN_HEIGHT / 2) {
+// A WORM_RADIUS thick segment: a quad along it and a disc on its end, so
+// consecutive segments join up round. Segments across the wrap are skipped.
+void batchThickLine(GeometryBatch *batch, Point from, Point to,
+                    SDL_Color color) {
+  float dx = to.x - from.x;
+  float dy = to.y - from.y;
+  if (fabsf(dx) > SCREEN_WIDTH / 2 || fabsf(dy) > SCREEN_HEIGHT / 2) {
     return;
   }
 
-  for (int dy = -WORM_RADIUS; dy <= WORM_RADIUS; dy++) {
-    for (int dx = -WORM_RADIUS; dx <= WORM_RADIUS; dx++) {
-      if (dx * dx + dy * dy <= WORM_RADIUS * WORM_RADIUS) {
-        SDL_RenderDrawLine(renderer, x1 + dx, y1 + dy, x2 + dx, y2 + dy);
-      }
-    }
+  float length = sqrtf(dx * dx + dy * dy);
+  if (length > 0 && reserveBatch(batch, 6)) {
+    float nx = -dy / length * WORM_RADIUS;
+    float ny = dx / length * WORM_RADIUS;
+    addVertex(batch, from.x + nx, from.y + ny, color);
+    addVertex(batch, from.x - nx, from.y - ny, color);
+    addVertex(batch, to.x + nx, to.y + ny, color);
+    addVertex(batch, to.x + nx, to.y + ny, color);
+    addVertex(batch, from.x - nx, from.y - ny, color);
+    addVertex(batch, to.x - nx, to.y - ny, color);
   }
+  batchCircle(batch, to.x, to.y, WORM_RADIUS, color);
 }
 
-void drawWorm(SDL_Renderer *renderer, Worm *worm) {
-  if (!worm->alive) {
-    return;
+// Draws the batch to the current render target in one call and empties it
+void flushBatch(SDL_Renderer *renderer, GeometryBatch *batch) {
+  if (batch->count > 0) {
+    SDL_RenderGeometry(renderer, NULL, batch->vertices, batch->count, NULL, 0);
   }
+  batch->count = 0;
+}
 
-  Uint8 alpha = worm->is_ghost ? 128 : 255;
-  SDL_SetRenderDrawColor(renderer, worm->color.r, worm->color.g, worm->color.b,
-                         alpha);
+// Adds segments from..path_length - 1 of worm's trail, segment i being
+// path[i - 1] to path[i], to batch
+void batchTrail(GeometryBatch *batch, RemoteWorm *worm, int from) {
+  SDL_Color color = worm->color;
+  color.a = worm->is_ghost ? 128 : 255;
 
-  for (int i = 1; i < worm->path_length; i++) {
-    drawThickLine(renderer, (int)(worm->path[i - 1].x + 0.5),
-                  (int)(worm->path[i - 1].y + 0.5),
-                  (int)(worm->path[i].x + 0.5), (int)(worm->path[i].y + 0.5));
+  int first = from > 1 ? from : 1;
+  if (first < worm->path_length) {
+    batchCircle(batch, worm->path[first - 1].x, worm->path[first - 1].y,
+                WORM_RADIUS, color);
+  }
+  for (int i = first; i < worm->path_length; i++) {
+    batchThickLine(batch, worm->path[i - 1], worm->path[i], color);
+  }
+}
+
+// Brings canvas_texture up to date with the trails of view. Normally that
+// is the segments ending at points that arrived or moved since the last
+// frame; when the view is dirty or the canvas was lost it is a clear and
+// every trail from the start. fresh is whether the view is new this frame,
+// as its changes must only be applied once.
+void updateCanvas(SDL_Renderer *renderer, WorldView *view, bool fresh) {
+  SDL_SetRenderTarget(renderer, canvas_texture);
+  if (canvas_lost || (fresh && view->canvas_dirty)) {
+    SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255); // Dark gray background
+    SDL_RenderClear(renderer);
+    memset(drawn_length, 0, sizeof(drawn_length));
+    canvas_lost = false;
   }
 
-  SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255); // White bullets
+  for (int i = 0; i < view->num_worms; i++) {
+    RemoteWorm *worm = &view->worms[i];
+    int from = drawn_length[i];
+    if (fresh && view->redraw_from[i] < from) {
+      from = view->redraw_from[i];
+    }
+    if (worm->alive) {
+      batchTrail(&trail_batch, worm, from);
+    }
+    drawn_length[i] = worm->path_length;
+  }
+  flushBatch(renderer, &trail_batch);
+  SDL_SetRenderTarget(renderer, NULL);
+}
+
+// What changes every frame: bullets and the boost indicator. The trail is
+// in canvas_texture.
+void batchWorm(GeometryBatch *batch, RemoteWorm *worm) {
+  if (!worm->alive) {
+    return;
+  }
+
+  SDL_Color white = {255, 255, 255, 255}; // Bullets
   for (int i = 0; i < MAX_BULLETS; i++) {
     if (worm->bullets[i].active) {
-      drawCircle(renderer, (int)worm->bullets[i].position.x,
-                 (int)worm->bullets[i].position.y, BULLET_RADIUS);
+      batchCircle(batch, worm->bullets[i].position.x,
+                  worm->bullets[i].position.y, BULLET_RADIUS, white);
     }
   }
 
   if (worm->speed_boost_active) {
-    SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255); // Yellow indicator
-    drawCircle(renderer, (int)worm->position.x, (int)worm->position.y,
-               WORM_RADIUS + 5);
+    SDL_Color yellow = {255, 255, 0, 255}; // Boost indicator
+    batchCircle(batch, worm->position.x, worm->position.y, WORM_RADIUS + 5,
+                yellow);
+  }
+}
+
+// A prediction offset set at time, faded by PREDICTION_DECAY for every
+// frame since
+Point fade_offset(Point offset, Uint32 time) {
+  float frames = (SDL_GetTicks() - time) * CLIENT_TICK_RATE / 1000.0f;
+  float share = powf(PREDICTION_DECAY, frames);
+  return (Point){offset.x * share, offset.y * share};
+}
+
+// Extends our worm from the server's head along the predicted path. The
+// offset left by the last correction is spread along the extension, so it
+// stays attached to the body, and fades a little every frame.
+void batchPrediction(GeometryBatch *batch, WorldView *view) {
+  RemoteWorm *worm = &view->worms[view->player_id];
+  if (!worm->alive) {
+    return;
+  }
+  Point path[MAX_PENDING_INPUTS + 1];
+  Point offset =
+      fade_offset(view->prediction_offset, view->prediction_offset_time);
+  int length = view->predicted_length;
+  path[0] = worm->position;
+  for (int i = 0; i < length; i++) {
+    float share = (float)(i + 1) / length;
+    path[i + 1].x = view->predicted_path[i].x + offset.x * share;
+    path[i + 1].y = view->predicted_path[i].y + offset.y * share;
+  }
+  SDL_Color color = worm->color;
+  color.a = worm->is_ghost ? 128 : 255;
+  for (int i = 1; i <= length; i++) {
+    batchThickLine(batch, path[i - 1], path[i], color);
   }
 }
 
-void drawPowerups(SDL_Renderer *renderer) {
-  for (int i = 0; i < num_powerups; i++) {
-    if (powerups[i].type == POWERUP_BULLETS) {
-      SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255); // Red for bullets
-    } else if (powerups[i].type == POWERUP_SPEED) {
-      SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255); // Green for speed boost
-    } else if (powerups[i].type == POWERUP_GHOST) {
-      SDL_SetRenderDrawColor(renderer, 0, 0, 255, 255); // Blue for ghost
+void batchPowerups(GeometryBatch *batch, WorldView *view) {
+  for (int i = 0; i < view->num_powerups; i++) {
+    Powerup *powerup = &view->powerups[i];
+    SDL_Color color = {0, 0, 0, 255};
+    if (powerup->type == POWERUP_BULLETS) {
+      color.r = 255; // Red for bullets
+    } else if (powerup->type == POWERUP_SPEED) {
+      color.g = 255; // Green for speed boost
+    } else if (powerup->type == POWERUP_GHOST) {
+      color.b = 255; // Blue for ghost
+    }
+    batchCircle(batch, powerup->position.x, powerup->position.y,
+                POWERUP_RADIUS, color);
+  }
+}
+
+// The input and network threads both write to sock; frames must not
+// interleave.
+void send_to_server(const char *message) {
+  pthread_mutex_lock(&send_mutex);
+  send_message(sock, message);
+  pthread_mutex_unlock(&send_mutex);
+}
+
+// One tick of our worm under the sim's rules: steer, then move, boosted
+// while UP is held and boost time is left. Shots, collisions and pickups
+// are left to the server.
+Point predict_step(Point head, uint8_t bits) {
+  int tick_rate = atomic_load(&server_tick_rate);
+  predicted_angle = sim_turn(predicted_angle, bits, tick_rate);
+  float speed = WORM_SPEED * ((float)DEFAULT_TICK_RATE / tick_rate);
+  if ((bits & INPUT_UP) && predicted_boost_time > 0) {
+    speed *= SPEED_BOOST_MULTIPLIER;
+    predicted_boost_time -= 1.0 / tick_rate;
+  }
+  Point step;
+  return sim_move_head(head, predicted_angle, speed, &step);
+}
+
+// Copies decoded and the prediction into the back view and swaps it in for
+// the render loop. Only the path points that changed since the back view
+// was last filled are copied. Called with state_mutex held.
+void publish_view() {
+  WorldView *view = &views[view_back];
+  view->num_worms = decoded.num_worms;
+  view->num_powerups = decoded.num_powerups;
+  memcpy(view->powerups, decoded.powerups,
+         decoded.num_powerups * sizeof(Powerup));
+  for (int i = 0; i < decoded.num_worms; i++) {
+    RemoteWorm *worm = &view->worms[i];
+    Point *path = worm->path;
+    int capacity = worm->path_capacity;
+    *worm = decoded.worms[i];
+    if (worm->path_length > capacity) {
+      Point *grown = realloc(path, worm->path_capacity * sizeof(Point));
+      if (grown != NULL) {
+        path = grown;
+        capacity = worm->path_capacity;
+      } else {
+        // Show what fits; the next publish copies the rest and tries again
+        worm->path_length = capacity;
+      }
+    }
+    int synced = synced_length[view_back][i];
+    memcpy(path + synced, decoded.worms[i].path + synced,
+           (worm->path_length - synced) * sizeof(Point));
+    synced_length[view_back][i] = worm->path_length;
+    worm->path = path;
+    worm->path_capacity = capacity;
+  }
+
+  view->player_id = player_id;
+  memcpy(view->predicted_path, predicted_path,
+         predicted_length * sizeof(Point));
+  view->predicted_length = predicted_length;
+  view->prediction_offset = prediction_offset;
+  view->prediction_offset_time = prediction_offset_time;
+
+  // If the render loop has not taken the last view, it never will once
+  // this one replaces it, so this one carries its canvas changes as well
+  bool carry = atomic_load(&view_ready) & VIEW_FRESH;
+  view->canvas_dirty =
+      pending_canvas_dirty || (carry && published_canvas_dirty);
+  for (int i = 0; i < MAX_WORMS; i++) {
+    view->redraw_from[i] = pending_redraw_from[i];
+    if (carry && published_redraw_from[i] < view->redraw_from[i]) {
+      view->redraw_from[i] = published_redraw_from[i];
+    }
+    published_redraw_from[i] = view->redraw_from[i];
+    pending_redraw_from[i] = INT_MAX;
+  }
+  published_canvas_dirty = view->canvas_dirty;
+  pending_canvas_dirty = false;
+
+  view_back = atomic_exchange(&view_ready, view_back | VIEW_FRESH) &
+              ~VIEW_FRESH;
+}
+
+// The view the render loop draws: the newest one published. fresh is set
+// if it was not the one returned last time.
+WorldView *acquire_view(bool *fresh) {
+  *fresh = atomic_load(&view_ready) & VIEW_FRESH;
+  if (*fresh) {
+    view_front = atomic_exchange(&view_ready, view_front) & ~VIEW_FRESH;
+  }
+  return &views[view_front];
+}
+
+// Empties decoded and every view, before the network threads start
+void reset_views() {
+  memset(&decoded, 0, sizeof(decoded));
+  memset(views, 0, sizeof(views));
+  memset(synced_length, 0, sizeof(synced_length));
+  view_back = 0;
+  atomic_store(&view_ready, 1);
+  view_front = 2;
+  pending_canvas_dirty = false;
+  published_canvas_dirty = false;
+  for (int i = 0; i < MAX_WORMS; i++) {
+    pending_redraw_from[i] = INT_MAX;
+    published_redraw_from[i] = INT_MAX;
+  }
+  canvas_lost = true;
+}
+
+void free_views() {
+  for (int i = 0; i < MAX_WORMS; i++) {
+    free(decoded.worms[i].path);
+    for (int v = 0; v < 3; v++) {
+      free(views[v].worms[i].path);
+    }
+  }
+}
+
+// Moves our predicted head by an input just sent
+void predict_input(uint32_t seq, uint8_t bits) {
+  pthread_mutex_lock(&state_mutex);
+  pending_inputs[seq % MAX_PENDING_INPUTS] = bits;
+  predicted_seq = seq;
+  if (game_started && player_id >= 0 && player_id < decoded.num_worms &&
+      decoded.worms[player_id].alive &&
+      predicted_length < MAX_PENDING_INPUTS) {
+    RemoteWorm *worm = &decoded.worms[player_id];
+    Point head = worm->position;
+    if (predicted_length > 0) {
+      head = predicted_path[predicted_length - 1];
+    } else {
+      predicted_angle = worm->angle;
+      predicted_boost_time = worm->speed_boost_time_left;
+    }
+    predicted_path[predicted_length++] = predict_step(head, bits);
+    publish_view();
+  }
+  pthread_mutex_unlock(&state_mutex);
+}
+
+// Rebuilds the prediction on the STATE just applied: starts from the
+// server's head and replays the inputs it had not applied yet. Whatever
+// the drawn head moves by becomes prediction_offset. Called with
+// state_mutex held.
+void reconcile_prediction() {
+  Point drawn = {0, 0};
+  bool had_prediction = predicted_length > 0;
+  if (had_prediction) {
+    Point offset = fade_offset(prediction_offset, prediction_offset_time);
+    drawn.x = predicted_path[predicted_length - 1].x + offset.x;
+    drawn.y = predicted_path[predicted_length - 1].y + offset.y;
+  }
+  predicted_length = 0;
+  prediction_offset = (Point){0, 0};
+  prediction_offset_time = SDL_GetTicks();
+  if (player_id < 0 || player_id >= decoded.num_worms ||
+      !decoded.worms[player_id].alive) {
+    return;
+  }
+
+  RemoteWorm *worm = &decoded.worms[player_id];
+  predicted_angle = worm->angle;
+  predicted_boost_time = worm->speed_boost_time_left;
+  uint32_t first = worm->input_seq + 1;
+  if ((int32_t)(predicted_seq - worm->input_seq) > MAX_PENDING_INPUTS) {
+    first = predicted_seq - MAX_PENDING_INPUTS + 1;
+  }
+  Point head = worm->position;
+  for (uint32_t seq = first; (int32_t)(predicted_seq - seq) >= 0; seq++) {
+    head = predict_step(head, pending_inputs[seq % MAX_PENDING_INPUTS]);
+    predicted_path[predicted_length++] = head;
+  }
+
+  if (had_prediction) {
+    Point offset = {drawn.x - head.x, drawn.y - head.y};
+    if (offset.x * offset.x + offset.y * offset.y <
+        PREDICTION_SNAP_DISTANCE * PREDICTION_SNAP_DISTANCE) {
+      prediction_offset = offset;
     }
-    drawCircle(renderer, (int)powerups[i].position.x,
-               (int)powerups[i].position.y, POWERUP_RADIUS);
   }
 }
 
 void send_input() {
   pthread_mutex_lock(&input_mutex);
-  char input_buffer[50];
-  snprintf(input_buffer, sizeof(input_buffer), "INPUT %d %d %d",
-           current_input.left, current_input.right, current_input.up);
-  send(sock, input_buffer, strlen(input_buffer), 0);
+  uint8_t bits = (current_input.left ? INPUT_LEFT : 0) |
+                 (current_input.right ? INPUT_RIGHT : 0) |
+                 (current_input.up ? INPUT_UP : 0);
+  uint32_t seq = ++input_seq;
+  if (udp_sock >= 0) {
+    uint8_t datagram[32];
+    ByteWriter writer = {datagram, sizeof(datagram), 0, false};
+    put_u8(&writer, UDP_INPUT);
+    put_varint(&writer, udp_connection_id);
+    put_u64(&writer, udp_nonce);
+    put_varint(&writer, seq);
+    put_u8(&writer, bits);
+    put_varint(&writer, ack_seq);
+    send(udp_sock, datagram, writer.offset, 0);
+  } else {
+    char input_buffer[50];
+    snprintf(input_buffer, sizeof(input_buffer), "INPUT %d %d %d %u",
+             current_input.left, current_input.right, current_input.up, seq);
+    send_to_server(input_buffer);
+  }
   pthread_mutex_unlock(&input_mutex);
+  predict_input(seq, bits);
 }
 
 void *send_input_thread(void *arg) {
   while (1) {
     send_input();
-    usleep(1000000 / CLIENT_TICK_RATE); // Send at CLIENT_TICK_RATE Hz
+    usleep(1000000 / atomic_load(&server_tick_rate)); // One per server tick
   }
   return NULL;
 }
 
-void handle_server_messages() {
-  char buffer[16384 * 16];
-  int n;
-
-  while ((n = recv(sock, buffer, sizeof(buffer) - 1, 0)) > 0) {
-    buffer[n] = '\0';
-    printf("Received message: %.100s...\n", buffer);
-
-    if (strncmp(buffer, "GAME_STARTED", 12) == 0) {
-      game_started = true;
-      waiting_for_game_start = false;
-      game_start_time = SDL_GetTicks();
-      printf("Game started!\n");
-    } else if (strncmp(buffer, "GAME_OVER", 9) == 0) {
-      game_started = false;
-      printf("Game over!\n");
-    } else if (strncmp(buffer, "PLAYER_ID", 9) == 0) {
-      sscanf(buffer, "PLAYER_ID %d", &player_id);
-      printf("Assigned player ID: %d\n", player_id);
-    } else if (strncmp(buffer, "PLAYER_UPDATE", 13) == 0) {
-      int id;
-      char name[MAX_NAME_LENGTH];
-      sscanf(buffer, "PLAYER_UPDATE %d %s", &id, name);
-      bool found = false;
-      for (int i = 0; i < num_players; i++) {
-        if (players[i].id == id) {
-          strncpy(players[i].name, name, MAX_NAME_LENGTH);
-          found = true;
-          break;
-        }
-      }
-      if (!found && num_players < MAX_PLAYERS) {
-        players[num_players].id = id;
-        strncpy(players[num_players].name, name, MAX_NAME_LENGTH);
-        num_players++;
-      }
-    } else if (strncmp(buffer, "STATE", 5) == 0) {
-      int count = 0;
-      char *token = strtok(buffer, " ");
-      token = strtok(NULL, " ");
-      if (token != NULL) {
-        count = atoi(token);
-      }
+// Called by the decoders before they overwrite decoded worm index with a
+// record whose path is resent from path_start. Points rewritten in place
+// only need their segments drawn again; a trail that shrinks, vanishes,
+// changes look or is resent whole (a resync, or another worm now in this
+// slot) means pixels must be removed, which only a full redraw does. The
+// views no longer match decoded from path_start on either.
+void track_path_changes(int index, bool alive, bool is_ghost,
+                        int path_start, int path_length) {
+  RemoteWorm *worm = &decoded.worms[index];
+  if (alive != worm->alive || is_ghost != worm->is_ghost ||
+      path_length < worm->path_length ||
+      (path_start == 0 && worm->path_length > 0)) {
+    pending_canvas_dirty = true;
+  }
+  if (path_start < pending_redraw_from[index]) {
+    pending_redraw_from[index] = path_start;
+  }
+  for (int v = 0; v < 3; v++) {
+    if (path_start < synced_length[v][index]) {
+      synced_length[v][index] = path_start;
+    }
+  }
+}
 
-      printf("Parsed worm count: %d\n", count);
+// Parses a text STATE into decoded. Returns false if the
+// message was cut short, in which case the paths may be partially updated.
+bool parse_text_state(char *buffer, unsigned int *seq) {
+  int count = 0;
+  bool complete = false;
+  char *token = strtok(buffer, " ");
+  token = strtok(NULL, " ");
+  if (token != NULL) {
+    *seq = strtoul(token, NULL, 10);
+    token = strtok(NULL, " ");
+  }
+  if (token != NULL) {
+    count = atoi(token);
+  }
 
-      if (count < 0 || count > MAX_WORMS) {
-        fprintf(stderr, "Invalid worm count: %d\n", count);
-        continue;
-      }
+  log_debug("Parsed worm count: %d", count);
 
-      num_worms = count;
+  if (count < 0 || count > MAX_WORMS) {
+    log_error("Invalid worm count: %d", count);
+    return false;
+  }
 
-      token = strtok(NULL, " ");
-      if (token != NULL) {
-        num_powerups = atoi(token);
+  int powerup_count = decoded.num_powerups;
+  token = strtok(NULL, " ");
+  if (token != NULL) {
+    powerup_count = atoi(token);
+  }
+  if (powerup_count < 0 || powerup_count > MAX_POWERUPS) {
+    log_error("Invalid powerup count: %d", powerup_count);
+    return false;
+  }
+
+  if (count != decoded.num_worms) {
+    pending_canvas_dirty = true;
+  }
+  decoded.num_worms = count;
+  decoded.num_powerups = powerup_count;
+
+  log_debug("Number of powerups: %d", decoded.num_powerups);
+
+  for (int i = 0; i < decoded.num_powerups; i++) {
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    decoded.powerups[i].position.x = atof(token);
+
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    decoded.powerups[i].position.y = atof(token);
+
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    decoded.powerups[i].type = atoi(token);
+
+    log_debug("Powerup %d: x=%.2f, y=%.2f, type=%d", i,
+              decoded.powerups[i].position.x, decoded.powerups[i].position.y,
+              decoded.powerups[i].type);
+  }
+
+  for (int i = 0; i < decoded.num_worms; i++) {
+    RemoteWorm *worm = &decoded.worms[i];
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    int path_length = atoi(token);
+    complete = false;
+
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    float x = atof(token);
+
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    float y = atof(token);
+
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    float angle = atof(token);
+
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    bool alive = atoi(token);
+
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    int bullets_left = atoi(token);
+
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    float speed_boost_time_left = atof(token);
+
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    bool speed_boost_active = atoi(token);
+
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    bool is_ghost = atoi(token);
+
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    uint32_t input_seq = strtoul(token, NULL, 10);
+
+    token = strtok(NULL, " ");
+    if (token == NULL)
+      break;
+    int path_start = atoi(token);
+    if (path_length < 0 || path_start < 0 || path_start > path_length ||
+        path_start > worm->path_length) {
+      break;
+    }
+    track_path_changes(i, alive, is_ghost, path_start, path_length);
+
+    worm->position.x = x;
+    worm->position.y = y;
+    worm->angle = angle;
+    worm->alive = alive;
+    worm->color = colors[i % MAX_WORMS];
+    worm->bullets_left = bullets_left;
+    worm->speed_boost_time_left = speed_boost_time_left;
+    worm->speed_boost_active = speed_boost_active;
+    worm->is_ghost = is_ghost;
+    worm->input_seq = input_seq;
+
+    if (path_length > worm->path_capacity) {
+      Point *path = realloc(worm->path, path_length * sizeof(Point));
+      if (path == NULL) {
+        complete = false;
+        break;
       }
+      worm->path = path;
+      worm->path_capacity = path_length;
+    }
+    worm->path_length = path_start;
 
-      printf("Number of powerups: %d\n", num_powerups);
+    for (int j = 0; j < MAX_BULLETS; j++) {
+      token = strtok(NULL, " ");
+      if (token == NULL)
+        break;
+      float bullet_x = atof(token);
 
-      for (int i = 0; i < num_powerups; i++) {
-        token = strtok(NULL, " ");
-        if (token == NULL)
-          break;
-        powerups[i].position.x = atof(token);
+      token = strtok(NULL, " ");
+      if (token == NULL)
+        break;
+      float bullet_y = atof(token);
 
-        token = strtok(NULL, " ");
-        if (token == NULL)
-          break;
-        powerups[i].position.y = atof(token);
+      token = strtok(NULL, " ");
+      if (token == NULL)
+        break;
+      float bullet_angle = atof(token);
 
-        token = strtok(NULL, " ");
-        if (token == NULL)
-          break;
-        powerups[i].type = atoi(token);
+      worm->bullets[j].position.x = bullet_x;
+      worm->bullets[j].position.y = bullet_y;
+      worm->bullets[j].angle = bullet_angle;
+      worm->bullets[j].active = (bullet_x != 0 || bullet_y != 0);
+    }
 
-        printf("Powerup %d: x=%.2f, y=%.2f, type=%d\n", i,
-               powerups[i].position.x, powerups[i].position.y,
-               powerups[i].type);
-      }
+    // Only the points from path_start onwards are sent; the earlier
+    // ones are already in our copy of the path
+    for (int j = path_start; j < path_length; j++) {
+      token = strtok(NULL, " ");
+      if (token == NULL)
+        break;
+      worm->path[j].x = atof(token);
 
-      for (int i = 0; i < num_worms; i++) {
-        token = strtok(NULL, " ");
-        if (token == NULL)
-          break;
-        int path_length = atoi(token);
+      token = strtok(NULL, " ");
+      if (token == NULL)
+        break;
+      worm->path[j].y = atof(token);
+      worm->path_length = j + 1;
+    }
+    if (worm->path_length != path_length)
+      break;
+    complete = true;
+
+    log_debug("Parsed worm %d: x=%.2f, y=%.2f, angle=%.2f, alive=%d, "
+              "path_length=%d, bullets_left=%d, speed_boost_time_left=%.2f, "
+              "speed_boost_active=%d, is_ghost=%d",
+              i, worm->position.x, worm->position.y, worm->angle,
+              worm->alive, worm->path_length, worm->bullets_left,
+              worm->speed_boost_time_left, worm->speed_boost_active,
+              worm->is_ghost);
+  }
 
-        token = strtok(NULL, " ");
-        if (token == NULL)
-          break;
-        float x = atof(token);
+  return complete || decoded.num_worms == 0;
+}
 
-        token = strtok(NULL, " ");
-        if (token == NULL)
-          break;
-        float y = atof(token);
+// Decodes a binary STATE (see protocol.h) into decoded, with
+// the same semantics as parse_text_state.
+bool decode_binary_state(const uint8_t *data, size_t size, unsigned int *seq) {
+  ByteReader reader = {data, size, 0, false};
+  if (get_u8(&reader) != PROTOCOL_MAGIC ||
+      get_u8(&reader) != PROTOCOL_VERSION) {
+    log_error("Unsupported state encoding");
+    return false;
+  }
 
-        token = strtok(NULL, " ");
-        if (token == NULL)
-          break;
-        float angle = atof(token);
+  *seq = get_varint(&reader);
+  uint32_t count = get_varint(&reader);
+  uint32_t powerup_count = get_varint(&reader);
+  if (reader.error || count > MAX_WORMS || powerup_count > MAX_POWERUPS) {
+    log_error("Invalid state header");
+    return false;
+  }
 
-        token = strtok(NULL, " ");
-        if (token == NULL)
-          break;
-        bool alive = atoi(token);
+  decoded.num_powerups = powerup_count;
+  for (int i = 0; i < decoded.num_powerups; i++) {
+    decoded.powerups[i].position.x = get_coord(&reader);
+    decoded.powerups[i].position.y = get_coord(&reader);
+    decoded.powerups[i].type = get_u8(&reader);
+  }
 
-        token = strtok(NULL, " ");
-        if (token == NULL)
-          break;
-        int bullets_left = atoi(token);
+  if ((int)count != decoded.num_worms) {
+    pending_canvas_dirty = true;
+  }
+  decoded.num_worms = count;
+  for (int i = 0; i < decoded.num_worms; i++) {
+    RemoteWorm *worm = &decoded.worms[i];
+    uint8_t flags = get_u8(&reader);
+    bool alive = flags & WORM_FLAG_ALIVE;
+    bool is_ghost = flags & WORM_FLAG_GHOST;
+    worm->speed_boost_active = flags & WORM_FLAG_BOOST;
+    worm->color = colors[i % MAX_WORMS];
+    worm->position.x = get_coord(&reader);
+    worm->position.y = get_coord(&reader);
+    worm->angle = get_angle(&reader);
+    worm->bullets_left = get_u8(&reader);
+    worm->speed_boost_time_left = get_duration(&reader);
+    worm->input_seq = get_varint(&reader);
+
+    for (int j = 0; j < MAX_BULLETS; j++) {
+      worm->bullets[j].active = flags & (1 << (WORM_FLAG_BULLET_SHIFT + j));
+      if (worm->bullets[j].active) {
+        worm->bullets[j].position.x = get_coord(&reader);
+        worm->bullets[j].position.y = get_coord(&reader);
+        worm->bullets[j].angle = get_angle(&reader);
+      }
+    }
 
-        token = strtok(NULL, " ");
-        if (token == NULL)
-          break;
-        float speed_boost_time_left = atof(token);
+    int path_length = get_varint(&reader);
+    int path_start = get_varint(&reader);
+    if (reader.error || path_length < 0 || path_start > path_length ||
+        path_start > worm->path_length ||
+        reader.size - reader.offset < (size_t)(path_length - path_start) * 4) {
+      return false;
+    }
+    track_path_changes(i, alive, is_ghost, path_start, path_length);
+    worm->alive = alive;
+    worm->is_ghost = is_ghost;
+
+    if (path_length > worm->path_capacity) {
+      Point *path = realloc(worm->path, path_length * sizeof(Point));
+      if (path == NULL) {
+        return false;
+      }
+      worm->path = path;
+      worm->path_capacity = path_length;
+    }
+    for (int j = path_start; j < path_length; j++) {
+      worm->path[j].x = get_coord(&reader);
+      worm->path[j].y = get_coord(&reader);
+    }
+    worm->path_length = path_length;
+  }
+  return !reader.error;
+}
 
-        token = strtok(NULL, " ");
-        if (token == NULL)
-          break;
-        bool speed_boost_active = atoi(token);
+// The server builds its next delta on top of what we acknowledge here. After
+// a failed parse our paths are unusable, so ACK 0 asks for everything. Over
+// UDP the acknowledgement goes out with the next INPUT datagram.
+void send_ack(unsigned int seq) {
+  if (udp_sock >= 0) {
+    ack_seq = seq;
+    return;
+  }
+  char ack[32];
+  snprintf(ack, sizeof(ack), "ACK %u", seq);
+  send_to_server(ack);
+}
 
-        token = strtok(NULL, " ");
-        if (token == NULL)
-          break;
-        bool is_ghost = atoi(token);
+// Reads the sequence number of a STATE without decoding the rest of it.
+bool peek_state_seq(const uint8_t *frame, size_t length, unsigned int *seq) {
+  if (frame[0] == PROTOCOL_MAGIC) {
+    ByteReader reader = {frame, length, 0, false};
+    get_u8(&reader);
+    get_u8(&reader);
+    *seq = get_varint(&reader);
+    return !reader.error;
+  }
+  return sscanf((const char *)frame, "STATE %u", seq) == 1;
+}
 
-        token = strtok(NULL, " ");
-        if (token == NULL)
-          break;
-        int full_path_length = atoi(token);
-
-        worms[i].position.x = x;
-        worms[i].position.y = y;
-        worms[i].angle = angle;
-        worms[i].alive = alive;
-        worms[i].color = colors[i % MAX_WORMS];
-        worms[i].bullets_left = bullets_left;
-        worms[i].speed_boost_time_left = speed_boost_time_left;
-        worms[i].speed_boost_active = speed_boost_active;
-        worms[i].is_ghost = is_ghost;
-
-        if (full_path_length > worms[i].path_capacity) {
-          worms[i].path_capacity = full_path_length;
-          worms[i].path =
-              realloc(worms[i].path, worms[i].path_capacity * sizeof(Point));
-        }
-        worms[i].path_length = full_path_length;
-
-        for (int j = 0; j < MAX_BULLETS; j++) {
-          token = strtok(NULL, " ");
-          if (token == NULL)
-            break;
-          float bullet_x = atof(token);
-
-          token = strtok(NULL, " ");
-          if (token == NULL)
-            break;
-          float bullet_y = atof(token);
-
-          token = strtok(NULL, " ");
-          if (token == NULL)
-            break;
-          float bullet_angle = atof(token);
-
-          worms[i].bullets[j].position.x = bullet_x;
-          worms[i].bullets[j].position.y = bullet_y;
-          worms[i].bullets[j].angle = bullet_angle;
-          worms[i].bullets[j].active = (bullet_x != 0 || bullet_y != 0);
-        }
+void open_udp_channel(uint32_t connection_id, uint64_t nonce);
+
+void handle_message(char *buffer) {
+  log_debug("Received message: %.100s...", buffer);
+
+  if (strncmp(buffer, "GAME_STARTED", 12) == 0) {
+    game_started = true;
+    waiting_for_game_start = false;
+    game_start_time = SDL_GetTicks();
+    log_info("Game started!");
+  } else if (strncmp(buffer, "GAME_OVER", 9) == 0) {
+    game_started = false;
+    log_info("Game over!");
+  } else if (strncmp(buffer, "UDP_TOKEN", 9) == 0) {
+    unsigned int connection_id;
+    unsigned long long nonce;
+    if (sscanf(buffer, "UDP_TOKEN %u %llu", &connection_id, &nonce) == 2) {
+      open_udp_channel(connection_id, nonce);
+    }
+  } else if (strncmp(buffer, "TICK_RATE", 9) == 0) {
+    int rate;
+    if (sscanf(buffer, "TICK_RATE %d", &rate) == 1 && rate > 0) {
+      atomic_store(&server_tick_rate, rate);
+    }
+  } else if (strncmp(buffer, "PLAYER_ID", 9) == 0) {
+    pthread_mutex_lock(&state_mutex);
+    sscanf(buffer, "PLAYER_ID %d", &player_id);
+    predicted_length = 0; // Predicted for the worm we used to be
+    publish_view();
+    pthread_mutex_unlock(&state_mutex);
+    log_info("Assigned player ID: %d", player_id);
+  } else if (strncmp(buffer, "PLAYER_UPDATE", 13) == 0) {
+    int id;
+    char name[MAX_NAME_LENGTH];
+    sscanf(buffer, "PLAYER_UPDATE %d %s", &id, name);
+    bool found = false;
+    for (int i = 0; i < num_players; i++) {
+      if (players[i].id == id) {
+        strncpy(players[i].name, name, MAX_NAME_LENGTH);
+        found = true;
+        break;
+      }
+    }
+    if (!found && num_players < MAX_PLAYERS) {
+      players[num_players].id = id;
+      strncpy(players[num_players].name, name, MAX_NAME_LENGTH);
+      num_players++;
+    }
+  }
+}
 
-        for (int j = 0; j < worms[i].path_length; j++) {
-          token = strtok(NULL, " ");
-          if (token == NULL)
-            break;
-          worms[i].path[j].x = atof(token);
+// Snapshots arrive over both TCP and UDP, so one may overtake another;
+// anything older than what is already applied is dropped unread.
+void handle_state(uint8_t *frame, size_t length) {
+  unsigned int seq = 0;
+  pthread_mutex_lock(&state_mutex);
+  if (!peek_state_seq(frame, length, &seq) || seq <= last_state_seq) {
+    pthread_mutex_unlock(&state_mutex);
+    return;
+  }
+  bool complete = frame[0] == PROTOCOL_MAGIC
+                      ? decode_binary_state(frame, length, &seq)
+                      : parse_text_state((char *)frame, &seq);
+  if (complete) {
+    last_state_seq = seq;
+    reconcile_prediction();
+    publish_view();
+  }
+  send_ack(complete ? seq : 0);
+  pthread_mutex_unlock(&state_mutex);
+}
 
-          token = strtok(NULL, " ");
-          if (token == NULL)
-            break;
-          worms[i].path[j].y = atof(token);
-        }
+void handle_server_messages() {
+  RecvBuffer buffer;
+  if (!recv_buffer_init(&buffer, SERVER_RECV_BUFFER_SIZE)) {
+    return;
+  }
 
-        printf("Parsed worm %d: x=%.2f, y=%.2f, angle=%.2f, alive=%d, "
-               "path_length=%d, bullets_left=%d, speed_boost_time_left=%.2f, "
-               "speed_boost_active=%d, is_ghost=%d\n",
-               i, worms[i].position.x, worms[i].position.y, worms[i].angle,
-               worms[i].alive, worms[i].path_length, worms[i].bullets_left,
-               worms[i].speed_boost_time_left, worms[i].speed_boost_active,
-               worms[i].is_ghost);
+  ssize_t n;
+  while ((n = recv_buffer_fill(&buffer, sock)) > 0) {
+    uint8_t *frame;
+    uint8_t *state = NULL;
+    size_t length, state_length = 0;
+    while ((frame = (uint8_t *)recv_buffer_next_frame(&buffer, &length)) !=
+           NULL) {
+      if (length == 0) {
+        continue;
       }
+      bool text = frame[length - 1] == '\0';
+      if (frame[0] == PROTOCOL_MAGIC ||
+          (text && strncmp((char *)frame, "STATE", 5) == 0)) {
+        // Only the newest of several queued snapshots is worth decoding
+        state = frame;
+        state_length = length;
+      } else if (text) {
+        handle_message((char *)frame);
+      }
+    }
+    if (state != NULL) {
+      handle_state(state, state_length);
     }
   }
+  recv_buffer_free(&buffer);
 
   if (n == 0) {
-    printf("Server disconnected\n");
+    log_info("Server disconnected");
   } else if (n < 0) {
-    perror("recv failed");
+    log_error("recv failed: %s", strerror(errno));
   }
 }
 
+void *handle_udp_messages(void *arg) {
+  (void)arg;
+  static uint8_t datagram[65536];
+  ssize_t n;
+  while ((n = recv(udp_sock, datagram, sizeof(datagram) - 1, 0)) >= 0) {
+    if (n == 0) {
+      continue;
+    }
+    datagram[n] = '\0'; // Text STATE datagrams carry no terminator
+    handle_state(datagram, n);
+  }
+  log_error("UDP recv failed: %s", strerror(errno));
+  return NULL;
+}
+
+// Opens the UDP channel to the address the TCP connection goes to. Until
+// the first INPUT datagram reaches the server, snapshots keep coming on TCP.
+void open_udp_channel(uint32_t connection_id, uint64_t nonce) {
+  if (udp_sock >= 0) {
+    return;
+  }
+
+  struct sockaddr_in server_addr;
+  socklen_t addr_len = sizeof(server_addr);
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0 ||
+      getpeername(sock, (struct sockaddr *)&server_addr, &addr_len) < 0 ||
+      connect(fd, (struct sockaddr *)&server_addr, addr_len) < 0) {
+    log_error("UDP channel failed, staying on TCP: %s", strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&input_mutex);
+  udp_connection_id = connection_id;
+  udp_nonce = nonce;
+  ack_seq = last_state_seq;
+  udp_sock = fd;
+  pthread_mutex_unlock(&input_mutex);
+
+  pthread_t udp_thread;
+  pthread_create(&udp_thread, NULL, handle_udp_messages, NULL);
+  pthread_detach(udp_thread);
+}
+
 int main(int argc, char *args[]) {
   SDL_Window *window = NULL;
   SDL_Renderer *renderer = NULL;
   SDL_Event event;
   bool quit = false;
 
+  int level = LOG_INFO;
+  if (argc == 3 && strcmp(args[1], "--log-level") == 0) {
+    level = log_level_from_name(args[2]);
+  }
+  if (level < 0) {
+    log_error("Invalid log level: %s", args[2]);
+    return 1;
+  }
+  log_init(level);
+
   if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-    printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+    log_error("SDL could not initialize! SDL_Error: %s", SDL_GetError());
     return 1;
   }
 
   if (TTF_Init() == -1) {
-    printf("SDL_ttf could not initialize! SDL_ttf Error: %s\n", TTF_GetError());
+    log_error("SDL_ttf could not initialize! SDL_ttf Error: %s",
+              TTF_GetError());
     return 1;
   }
 
@@ -714,19 +1425,19 @@ int main(int argc, char *args[]) {
                             SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH,
                             SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
   if (window == NULL) {
-    printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
+    log_error("Window could not be created! SDL_Error: %s", SDL_GetError());
     return 1;
   }
 
   renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
   if (renderer == NULL) {
-    printf("Renderer could not be created! SDL_Error: %s\n", SDL_GetError());
+    log_error("Renderer could not be created! SDL_Error: %s", SDL_GetError());
     return 1;
   }
 
   font = TTF_OpenFont("./cmunui.ttf", 24);
   if (font == NULL) {
-    printf("Failed to load font! SDL_ttf Error: %s\n", TTF_GetError());
+    log_error("Failed to load font! SDL_ttf Error: %s", TTF_GetError());
     return 1;
   }
 
@@ -751,7 +1462,7 @@ int main(int argc, char *args[]) {
             if (server_pid == 0) {
               // Child process: execute the server
               execl("./server", "./server", NULL);
-              exit(1); // This line is reached only if execl fails
+              _exit(1); // This line is reached only if execl fails
             } else if (server_pid > 0) {
               // Parent process: connect to the local server
               hosting = true;
@@ -760,7 +1471,7 @@ int main(int argc, char *args[]) {
 
               // Connect to localhost
               if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-                printf("\n Socket creation error \n");
+                log_error("Socket creation error");
                 return -1;
               }
 
@@ -770,17 +1481,17 @@ int main(int argc, char *args[]) {
                   htons(8080); // Assuming the server uses port 8080
 
               if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
-                printf("\nInvalid address/ Address not supported \n");
+                log_error("Invalid address/ Address not supported");
                 return -1;
               }
 
               if (connect(sock, (struct sockaddr *)&serv_addr,
                           sizeof(serv_addr)) < 0) {
-                printf("\nConnection Failed \n");
+                log_error("Connection Failed");
                 return -1;
               }
             } else {
-              perror("Failed to fork");
+              log_error("Failed to fork: %s", strerror(errno));
             }
           } else if (is_point_in_rect(x, y, &join_button.rect)) {
             // Join Game button clicked
@@ -827,7 +1538,7 @@ int main(int argc, char *args[]) {
       int selected_server = choose_server(renderer);
       if (selected_server != -1) {
         if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-          printf("\n Socket creation error \n");
+          log_error("Socket creation error");
           return -1;
         }
 
@@ -837,13 +1548,13 @@ int main(int argc, char *args[]) {
 
         if (inet_pton(AF_INET, servers[selected_server].ip,
                       &serv_addr.sin_addr) <= 0) {
-          printf("\nInvalid address/ Address not supported \n");
+          log_error("Invalid address/ Address not supported");
           return -1;
         }
 
         if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) <
             0) {
-          printf("\nConnection Failed \n");
+          log_error("Connection Failed");
           return -1;
         }
       }
@@ -855,24 +1566,14 @@ int main(int argc, char *args[]) {
                                          SDL_TEXTUREACCESS_TARGET, SCREEN_WIDTH,
                                          SCREEN_HEIGHT);
       if (canvas_texture == NULL) {
-        printf("Canvas texture could not be created! SDL_Error: %s\n",
-               SDL_GetError());
+        log_error("Canvas texture could not be created! SDL_Error: %s",
+                  SDL_GetError());
         return 1;
       }
 
-      SDL_SetRenderTarget(renderer, canvas_texture);
-      SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-      SDL_RenderClear(renderer);
-      SDL_SetRenderTarget(renderer, NULL);
+      reset_views(); // The canvas is cleared and drawn on the first frame
 
-      send(sock, "JOIN", 4, 0);
-
-      // Initialize worms
-      for (int i = 0; i < MAX_WORMS; i++) {
-        worms[i].path_capacity = 100; // Start with space for 100 points
-        worms[i].path = malloc(worms[i].path_capacity * sizeof(Point));
-        worms[i].path_length = 0;
-      }
+      send_to_server("JOIN");
 
       pthread_t server_thread, input_thread;
       pthread_create(&server_thread, NULL,
@@ -890,11 +1591,13 @@ int main(int argc, char *args[]) {
         while (SDL_PollEvent(&event) != 0) {
           if (event.type == SDL_QUIT) {
             quit = true;
+          } else if (event.type == SDL_RENDER_TARGETS_RESET) {
+            canvas_lost = true; // The driver lost the canvas contents
           } else if (event.type == SDL_KEYDOWN && event.key.repeat == 0) {
             switch (event.key.keysym.sym) {
             case SDLK_SPACE:
               if (!game_started) {
-                send(sock, "START", 5, 0);
+                send_to_server("START");
               }
               break;
             }
@@ -911,15 +1614,19 @@ int main(int argc, char *args[]) {
           current_input.up = keystate[SDL_SCANCODE_UP];
           pthread_mutex_unlock(&input_mutex);
 
-          SDL_SetRenderDrawColor(renderer, 50, 50, 50,
-                                 255); // Dark gray background
-          SDL_RenderClear(renderer);
+          bool fresh;
+          WorldView *view = acquire_view(&fresh);
+          updateCanvas(renderer, view, fresh);
+          SDL_RenderCopy(renderer, canvas_texture, NULL, NULL);
 
-          drawPowerups(renderer);
-
-          for (int i = 0; i < num_worms; i++) {
-            drawWorm(renderer, &worms[i]);
+          batchPowerups(&overlay_batch, view);
+          for (int i = 0; i < view->num_worms; i++) {
+            batchWorm(&overlay_batch, &view->worms[i]);
+          }
+          if (view->player_id >= 0 && view->player_id < view->num_worms) {
+            batchPrediction(&overlay_batch, view);
           }
+          flushBatch(renderer, &overlay_batch);
 
           SDL_RenderPresent(renderer);
         }
@@ -928,10 +1635,7 @@ int main(int argc, char *args[]) {
       }
 
       // Cleanup
-      for (int i = 0; i < MAX_WORMS; i++) {
-        free(worms[i].path);
-      }
-
+      free_views();
       close(sock);
       SDL_DestroyTexture(canvas_texture);
     }
@@ -945,6 +1649,9 @@ int main(int argc, char *args[]) {
     waitpid(server_pid, &status, 0);
   }
 
+  free(trail_batch.vertices);
+  free(overlay_batch.vertices);
+  free_text_cache();
   TTF_CloseFont(font);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
@@ -0,0 +1,547 @@
+// Headless load generator: N bot clients that JOIN, START and steer like
+// players, while measuring what they get back. Prints one JSON object with
+// per-connection snapshot rate, bytes per second and input-to-state latency
+// percentiles, plus the same figures over all connections.
+//
+// Latency is measured from the moment a bot starts turning to the first
+// STATE in which its own worm's heading moves that way.
+#define _DEFAULT_SOURCE // clock_gettime under -std=c11 on glibc
+#include "protocol.h"
+#include "sim.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVER_RECV_BUFFER_SIZE (64 * 1024)
+#define TURN_TICKS 30 // Zigzag: ticks between turning left and right
+
+typedef enum { INPUT_MODE_RANDOM, INPUT_MODE_ZIGZAG } InputMode;
+
+typedef struct {
+  int socket;
+  int udp_socket; // -1 until UDP_TOKEN, or without --udp
+  RecvBuffer buffer;
+  int64_t joined_ns;
+  bool start_sent;
+  int player_id; // -1 until PLAYER_ID
+  uint32_t udp_id;
+  uint64_t udp_nonce;
+  uint32_t input_seq;
+  unsigned int last_seq; // Newest STATE applied
+  uint8_t input;         // INPUT_* bits being sent
+  int pending_turn;      // -1 left, 1 right, 0 none awaiting its STATE
+  int64_t turn_ns;       // When pending_turn was first sent
+  float last_angle;
+  bool have_angle;
+  bool dead;
+  // Totals across reconnects
+  unsigned long snapshots;
+  unsigned long bytes;
+  unsigned long reconnects;
+  uint32_t *latencies_us;
+  size_t num_latencies;
+  size_t latency_capacity;
+} Bot;
+
+const char *host = "127.0.0.1";
+int port = 8080;
+int num_bots = 6;
+double duration = 10;       // Seconds
+int lobby_wait_ms = 500;    // Time from JOIN to START
+bool use_udp = false;       // --udp: INPUT and STATE over the UDP channel
+bool rejoin = false;        // --rejoin: reconnect when the bot's worm dies
+// The server's simulation rate, from TICK_RATE. Bots send one input per
+// server tick, as client.c does.
+int server_tick_rate = DEFAULT_TICK_RATE;
+InputMode input_mode = INPUT_MODE_RANDOM;
+struct sockaddr_in server_addr;
+Bot *bots = NULL;
+uint32_t rng_state = 2463534242u;
+
+int64_t monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+uint32_t loadgen_rand() {
+  uint32_t x = rng_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return rng_state = x;
+}
+
+bool connect_bot(Bot *bot) {
+  bot->socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (bot->socket < 0 ||
+      connect(bot->socket, (struct sockaddr *)&server_addr,
+              sizeof(server_addr)) < 0) {
+    perror("connect");
+    if (bot->socket >= 0) {
+      close(bot->socket);
+    }
+    bot->socket = -1;
+    return false;
+  }
+  if (!recv_buffer_init(&bot->buffer, SERVER_RECV_BUFFER_SIZE)) {
+    close(bot->socket);
+    bot->socket = -1;
+    return false;
+  }
+
+  bot->udp_socket = -1;
+  bot->joined_ns = monotonic_ns();
+  bot->start_sent = false;
+  bot->player_id = -1;
+  bot->input_seq = 0;
+  bot->last_seq = 0;
+  bot->input = 0;
+  bot->pending_turn = 0;
+  bot->have_angle = false;
+  bot->dead = false;
+  send_message(bot->socket, "JOIN");
+  return true;
+}
+
+void disconnect_bot(Bot *bot) {
+  if (bot->socket >= 0) {
+    close(bot->socket);
+    recv_buffer_free(&bot->buffer);
+    bot->socket = -1;
+  }
+  if (bot->udp_socket >= 0) {
+    close(bot->udp_socket);
+    bot->udp_socket = -1;
+  }
+}
+
+void open_udp(Bot *bot, uint32_t id, uint64_t nonce) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&server_addr,
+                        sizeof(server_addr)) < 0) {
+    perror("UDP socket");
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  bot->udp_socket = fd;
+  bot->udp_id = id;
+  bot->udp_nonce = nonce;
+}
+
+void record_latency(Bot *bot, int64_t latency_ns) {
+  if (bot->num_latencies == bot->latency_capacity) {
+    bot->latency_capacity = bot->latency_capacity ? bot->latency_capacity * 2
+                                                  : 256;
+    bot->latencies_us = realloc(bot->latencies_us,
+                                bot->latency_capacity * sizeof(uint32_t));
+  }
+  bot->latencies_us[bot->num_latencies++] = latency_ns / 1000;
+}
+
+// Compares this STATE's heading for the bot's own worm with the last one;
+// turning left decreases the angle.
+void observe_own_worm(Bot *bot, float angle, bool alive) {
+  bot->dead = !alive; // A new round revives it
+  if (!alive) {
+    bot->pending_turn = 0;
+    return;
+  }
+  if (bot->have_angle && bot->pending_turn != 0) {
+    float delta = remainderf(angle - bot->last_angle, 2 * PI);
+    if ((bot->pending_turn < 0 && delta < 0) ||
+        (bot->pending_turn > 0 && delta > 0)) {
+      record_latency(bot, monotonic_ns() - bot->turn_ns);
+      bot->pending_turn = 0;
+    }
+  }
+  bot->last_angle = angle;
+  bot->have_angle = true;
+}
+
+// Walks a binary STATE (layout in protocol.h) far enough to find the bot's
+// own worm. Returns false if it is malformed.
+bool parse_binary_state(Bot *bot, const uint8_t *data, size_t size,
+                        unsigned int *seq) {
+  ByteReader reader = {data, size, 0, false};
+  get_u8(&reader);
+  get_u8(&reader);
+  *seq = get_varint(&reader);
+  uint32_t count = get_varint(&reader);
+  uint32_t powerups = get_varint(&reader);
+  if (reader.error || count > SIM_MAX_WORMS || powerups > MAX_POWERUPS) {
+    return false;
+  }
+  reader.offset += powerups * 5; // x, y, type
+
+  for (uint32_t i = 0; i < count && !reader.error; i++) {
+    uint8_t flags = get_u8(&reader);
+    get_coord(&reader);
+    get_coord(&reader);
+    float angle = get_angle(&reader);
+    get_u8(&reader);
+    get_duration(&reader);
+    get_varint(&reader); // Input sequence
+    for (int j = 0; j < MAX_BULLETS; j++) {
+      if (flags & (1 << (WORM_FLAG_BULLET_SHIFT + j))) {
+        reader.offset += 6; // x, y, angle
+      }
+    }
+    uint32_t path_length = get_varint(&reader);
+    uint32_t path_start = get_varint(&reader);
+    if (path_start > path_length) {
+      return false;
+    }
+    reader.offset += (path_length - path_start) * 4;
+    if ((int)i == bot->player_id) {
+      observe_own_worm(bot, angle, flags & WORM_FLAG_ALIVE);
+    }
+  }
+  return !reader.error && reader.offset <= size;
+}
+
+// The same for a text STATE
+bool parse_text_state(Bot *bot, const char *text, unsigned int *seq) {
+  char *cursor;
+  int count, powerups;
+  if (sscanf(text, "STATE %u %d %d", seq, &count, &powerups) != 3 ||
+      count > SIM_MAX_WORMS || powerups > MAX_POWERUPS) {
+    return false;
+  }
+  cursor = strstr(text, " ") + 1;
+  for (int skip = 0; skip < 3 + powerups * 3; skip++) {
+    strtod(cursor, &cursor); // seq, count and powerups come first
+  }
+
+  for (int i = 0; i < count; i++) {
+    int path_length = strtol(cursor, &cursor, 10);
+    strtod(cursor, &cursor);
+    strtod(cursor, &cursor);
+    float angle = strtod(cursor, &cursor);
+    int alive = strtol(cursor, &cursor, 10);
+    for (int skip = 0; skip < 5; skip++) {
+      strtod(cursor, &cursor); // bullets, boost time, boost, ghost, input
+    }
+    int path_start = strtol(cursor, &cursor, 10);
+    if (path_start > path_length) {
+      return false;
+    }
+    for (int skip = 0; skip < MAX_BULLETS * 3 + (path_length - path_start) * 2;
+         skip++) {
+      strtod(cursor, &cursor);
+    }
+    if (i == bot->player_id) {
+      observe_own_worm(bot, angle, alive);
+    }
+  }
+  return true;
+}
+
+void handle_state(Bot *bot, const uint8_t *frame, size_t length) {
+  unsigned int seq = 0;
+  bool ok = frame[0] == PROTOCOL_MAGIC
+                ? parse_binary_state(bot, frame, length, &seq)
+                : parse_text_state(bot, (const char *)frame, &seq);
+  if (!ok || seq <= bot->last_seq) {
+    return;
+  }
+  bot->last_seq = seq;
+  bot->snapshots++;
+  if (bot->udp_socket < 0) {
+    char ack[32];
+    snprintf(ack, sizeof(ack), "ACK %u", seq);
+    send_message(bot->socket, ack);
+  }
+}
+
+void handle_message(Bot *bot, const char *text) {
+  unsigned int id;
+  unsigned long long nonce;
+  if (strncmp(text, "PLAYER_ID", 9) == 0) {
+    sscanf(text, "PLAYER_ID %d", &bot->player_id);
+    bot->have_angle = false;
+  } else if (strncmp(text, "TICK_RATE", 9) == 0) {
+    int rate;
+    if (sscanf(text, "TICK_RATE %d", &rate) == 1 && rate > 0) {
+      server_tick_rate = rate;
+    }
+  } else if (use_udp && bot->udp_socket < 0 &&
+             sscanf(text, "UDP_TOKEN %u %llu", &id, &nonce) == 2) {
+    open_udp(bot, id, nonce);
+  }
+}
+
+// Returns false when the server closed the connection
+bool read_tcp(Bot *bot) {
+  ssize_t n = recv_buffer_fill(&bot->buffer, bot->socket);
+  if (n <= 0) {
+    return false;
+  }
+  bot->bytes += n;
+
+  const uint8_t *frame;
+  size_t length;
+  while ((frame = recv_buffer_next_frame(&bot->buffer, &length)) != NULL) {
+    if (length == 0) {
+      continue;
+    }
+    bool text = frame[length - 1] == '\0';
+    if (frame[0] == PROTOCOL_MAGIC ||
+        (text && strncmp((const char *)frame, "STATE", 5) == 0)) {
+      handle_state(bot, frame, length);
+    } else if (text) {
+      handle_message(bot, (const char *)frame);
+    }
+  }
+  return true;
+}
+
+void read_udp(Bot *bot) {
+  static uint8_t datagram[65536];
+  ssize_t n = recv(bot->udp_socket, datagram, sizeof(datagram) - 1, 0);
+  if (n > 0) {
+    bot->bytes += n;
+    datagram[n] = '\0'; // Text STATE datagrams carry no terminator
+    handle_state(bot, datagram, n);
+  }
+}
+
+// Picks this tick's input and sends it. A change to turning starts a
+// latency measurement unless one is already waiting for its STATE.
+void send_input(Bot *bot, unsigned long tick) {
+  uint8_t input = bot->input;
+  if (input_mode == INPUT_MODE_ZIGZAG) {
+    input = (tick / TURN_TICKS) % 2 ? INPUT_RIGHT : INPUT_LEFT;
+  } else if (loadgen_rand() % TURN_TICKS == 0) {
+    static const uint8_t choices[] = {0, INPUT_LEFT, INPUT_RIGHT};
+    input = choices[loadgen_rand() % 3];
+  }
+  if (input != bot->input && input != 0 && bot->pending_turn == 0 &&
+      !bot->dead) {
+    bot->pending_turn = input == INPUT_LEFT ? -1 : 1;
+    bot->turn_ns = monotonic_ns();
+  }
+  bot->input = input;
+
+  if (bot->udp_socket >= 0) {
+    uint8_t datagram[32];
+    ByteWriter writer = {datagram, sizeof(datagram), 0, false};
+    put_u8(&writer, UDP_INPUT);
+    put_varint(&writer, bot->udp_id);
+    put_u64(&writer, bot->udp_nonce);
+    put_varint(&writer, ++bot->input_seq);
+    put_u8(&writer, input);
+    put_varint(&writer, bot->last_seq);
+    send(bot->udp_socket, datagram, writer.offset, 0);
+  } else {
+    char message[32];
+    snprintf(message, sizeof(message), "INPUT %d %d %d %u",
+             (input & INPUT_LEFT) != 0, (input & INPUT_RIGHT) != 0,
+             (input & INPUT_UP) != 0, ++bot->input_seq);
+    send_message(bot->socket, message);
+  }
+}
+
+int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Sorts samples in place and prints them as a JSON latency object in ms
+void print_latency(uint32_t *samples, size_t count) {
+  if (count == 0) {
+    printf("null");
+    return;
+  }
+  qsort(samples, count, sizeof(uint32_t), compare_u32);
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  static const char *names[] = {"p50", "p90", "p99", "p999"};
+  printf("{");
+  for (int i = 0; i < 4; i++) {
+    size_t index = quantiles[i] * (count - 1);
+    printf("\"%s\": %.3f, ", names[i], samples[index] / 1000.0);
+  }
+  printf("\"max\": %.3f}", samples[count - 1] / 1000.0);
+}
+
+void print_report(double elapsed) {
+  size_t total_samples = 0;
+  unsigned long total_snapshots = 0, total_bytes = 0, total_reconnects = 0;
+  for (int i = 0; i < num_bots; i++) {
+    total_samples += bots[i].num_latencies;
+  }
+  uint32_t *all = malloc((total_samples ? total_samples : 1) *
+                         sizeof(uint32_t));
+  size_t offset = 0;
+
+  printf("{\n  \"seconds\": %.3f,\n  \"connections\": [", elapsed);
+  for (int i = 0; i < num_bots; i++) {
+    Bot *bot = &bots[i];
+    memcpy(all + offset, bot->latencies_us,
+           bot->num_latencies * sizeof(uint32_t));
+    offset += bot->num_latencies;
+    total_snapshots += bot->snapshots;
+    total_bytes += bot->bytes;
+    total_reconnects += bot->reconnects;
+
+    printf("%s\n    {\"id\": %d, \"snapshots_per_s\": %.1f, "
+           "\"bytes_per_s\": %.0f, \"reconnects\": %lu, \"samples\": %zu, "
+           "\"latency_ms\": ",
+           i ? "," : "", i, bot->snapshots / elapsed, bot->bytes / elapsed,
+           bot->reconnects, bot->num_latencies);
+    print_latency(bot->latencies_us, bot->num_latencies);
+    printf("}");
+  }
+
+  printf("\n  ],\n  \"total\": {\"connections\": %d, "
+         "\"snapshots_per_s\": %.1f, \"bytes_per_s\": %.0f, "
+         "\"reconnects\": %lu, \"samples\": %zu, \"latency_ms\": ",
+         num_bots, total_snapshots / elapsed, total_bytes / elapsed,
+         total_reconnects, total_samples);
+  print_latency(all, total_samples);
+  printf("}\n}\n");
+  free(all);
+}
+
+void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [--host ADDR] [--port N] [--clients N] [--duration S]\n"
+          "          [--lobby-wait MS] [--input random|zigzag] [--udp] "
+          "[--rejoin]\n",
+          program);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--host") == 0 && has_value) {
+      host = argv[++i];
+    } else if (strcmp(argv[i], "--port") == 0 && has_value) {
+      port = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--clients") == 0 && has_value) {
+      num_bots = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--duration") == 0 && has_value) {
+      duration = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--lobby-wait") == 0 && has_value) {
+      lobby_wait_ms = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--input") == 0 && has_value) {
+      i++;
+      if (strcmp(argv[i], "zigzag") == 0) {
+        input_mode = INPUT_MODE_ZIGZAG;
+      } else if (strcmp(argv[i], "random") != 0) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--udp") == 0) {
+      use_udp = true;
+    } else if (strcmp(argv[i], "--rejoin") == 0) {
+      rejoin = true;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (num_bots <= 0 || duration <= 0) {
+    usage(argv[0]);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
+    fprintf(stderr, "Invalid address: %s\n", host);
+    return 1;
+  }
+
+  bots = calloc(num_bots, sizeof(Bot));
+  for (int i = 0; i < num_bots; i++) {
+    if (!connect_bot(&bots[i])) {
+      return 1;
+    }
+  }
+
+  struct pollfd *fds = malloc(2 * num_bots * sizeof(struct pollfd));
+  int *owners = malloc(2 * num_bots * sizeof(int));
+  int64_t start = monotonic_ns();
+  int64_t end = start + (int64_t)(duration * 1e9);
+  int64_t next_tick = start;
+  unsigned long tick = 0;
+
+  while (monotonic_ns() < end) {
+    int64_t now = monotonic_ns();
+    if (now >= next_tick) {
+      for (int i = 0; i < num_bots; i++) {
+        Bot *bot = &bots[i];
+        if (bot->socket < 0) {
+          continue;
+        }
+        if (!bot->start_sent &&
+            now - bot->joined_ns >= (int64_t)lobby_wait_ms * 1000000) {
+          send_message(bot->socket, "START");
+          bot->start_sent = true;
+        }
+        if (bot->dead && rejoin) {
+          disconnect_bot(bot);
+          bot->reconnects++;
+          connect_bot(bot);
+        } else if (bot->start_sent) {
+          send_input(bot, tick);
+        }
+      }
+      tick++;
+      next_tick += 1000000000 / server_tick_rate;
+    }
+
+    int count = 0;
+    for (int i = 0; i < num_bots; i++) {
+      if (bots[i].socket >= 0) {
+        fds[count] = (struct pollfd){bots[i].socket, POLLIN, 0};
+        owners[count++] = i;
+      }
+      if (bots[i].udp_socket >= 0) {
+        fds[count] = (struct pollfd){bots[i].udp_socket, POLLIN, 0};
+        owners[count++] = i;
+      }
+    }
+    int timeout_ms = (next_tick - monotonic_ns()) / 1000000;
+    int ready = poll(fds, count, timeout_ms > 0 ? timeout_ms : 0);
+    if (ready < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+    for (int k = 0; k < count && ready > 0; k++) {
+      if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+        continue;
+      }
+      Bot *bot = &bots[owners[k]];
+      if (fds[k].fd == bot->udp_socket) {
+        read_udp(bot);
+      } else if (fds[k].fd == bot->socket && !read_tcp(bot)) {
+        fprintf(stderr, "Bot %d: server closed the connection\n", owners[k]);
+        disconnect_bot(bot);
+      }
+    }
+  }
+
+  print_report((monotonic_ns() - start) / 1e9);
+  for (int i = 0; i < num_bots; i++) {
+    disconnect_bot(&bots[i]);
+    free(bots[i].latencies_us);
+  }
+  free(bots);
+  free(fds);
+  free(owners);
+  return 0;
+}
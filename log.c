@@ -0,0 +1,151 @@
+#define _DEFAULT_SOURCE // nanosleep under -std=c11 on glibc
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_IDLE_NS 10000000 // Writer's sleep when every ring is empty
+
+typedef struct {
+  int level;
+  char text[LOG_MESSAGE_SIZE];
+} LogMessage;
+
+// One per thread that has logged, never freed. The thread advances head
+// and the writer thread tail, so neither takes a lock.
+typedef struct LogRing {
+  LogMessage messages[LOG_RING_SIZE];
+  _Atomic uint32_t head;
+  _Atomic uint32_t tail;
+  _Atomic unsigned long dropped;
+  struct LogRing *next;
+} LogRing;
+
+_Atomic int log_level = LOG_INFO;
+
+static LogRing *_Atomic rings = NULL; // Newest first
+static _Thread_local LogRing *thread_ring = NULL;
+static atomic_bool running = false;
+static atomic_bool stopping = false;
+static pthread_t writer;
+
+static LogRing *get_thread_ring() {
+  if (thread_ring == NULL) {
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (ring == NULL) {
+      return NULL;
+    }
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+    }
+    thread_ring = ring;
+  }
+  return thread_ring;
+}
+
+static void write_message(int level, const char *text) {
+  FILE *stream = level <= LOG_WARN ? stderr : stdout;
+  fputs(text, stream);
+  fputc('\n', stream);
+}
+
+void log_write(int level, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  LogRing *ring = atomic_load(&running) ? get_thread_ring() : NULL;
+  if (ring == NULL) {
+    char text[LOG_MESSAGE_SIZE];
+    vsnprintf(text, sizeof(text), format, args);
+    write_message(level, text);
+  } else {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == LOG_RING_SIZE) {
+      atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    } else {
+      LogMessage *message = &ring->messages[head % LOG_RING_SIZE];
+      message->level = level;
+      vsnprintf(message->text, sizeof(message->text), format, args);
+      atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    }
+  }
+  va_end(args);
+}
+
+// Writes out every ring. Returns how many messages that was.
+static int drain() {
+  int written = 0;
+  for (LogRing *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    for (; tail != head; tail++) {
+      LogMessage *message = &ring->messages[tail % LOG_RING_SIZE];
+      write_message(message->level, message->text);
+      written++;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    unsigned long dropped = atomic_exchange(&ring->dropped, 0);
+    if (dropped > 0) {
+      fprintf(stderr, "%lu log messages dropped\n", dropped);
+    }
+  }
+  if (written > 0) {
+    fflush(stdout);
+    fflush(stderr);
+  }
+  return written;
+}
+
+static void *writer_loop(void *arg) {
+  (void)arg;
+  struct timespec idle = {0, LOG_IDLE_NS};
+  while (!atomic_load(&stopping)) {
+    if (drain() == 0) {
+      nanosleep(&idle, NULL);
+    }
+  }
+  drain();
+  return NULL;
+}
+
+void log_init(int level) {
+  static bool registered = false;
+  atomic_store(&log_level, level);
+  if (atomic_load(&running)) {
+    return;
+  }
+  atomic_store(&stopping, false);
+  if (pthread_create(&writer, NULL, writer_loop, NULL) != 0) {
+    return; // Callers keep writing directly
+  }
+  atomic_store(&running, true);
+  if (!registered) {
+    atexit(log_shutdown);
+    registered = true;
+  }
+}
+
+void log_shutdown() {
+  if (!atomic_exchange(&running, false)) {
+    return;
+  }
+  atomic_store(&stopping, true);
+  pthread_join(writer, NULL);
+}
+
+int log_level_from_name(const char *name) {
+  static const char *names[] = {"error", "warn", "info", "debug"};
+  for (int i = 0; i < 4; i++) {
+    if (strcmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,49 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+
+// Leveled logging that keeps I/O off the threads that log. A message is
+// formatted into a ring owned by the calling thread and written out by a
+// background thread, so logging never waits on a terminal or pipe; a
+// message that finds its ring full is dropped and counted instead.
+//
+// Calls above LOG_COMPILED_LEVEL are compiled out, arguments and all, and
+// calls above the runtime level cost a load and a branch. ERROR and WARN go
+// to stderr, INFO and DEBUG to stdout, each with a newline added.
+enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_MESSAGE_SIZE 256 // Longer messages are cut
+#define LOG_RING_SIZE 256    // Messages one thread may have waiting
+
+extern _Atomic int log_level;
+
+#define LOG_AT(level, ...)                                                     \
+  do {                                                                         \
+    if ((level) <= LOG_COMPILED_LEVEL &&                                       \
+        (level) <= atomic_load_explicit(&log_level, memory_order_relaxed)) {   \
+      log_write(level, __VA_ARGS__);                                           \
+    }                                                                          \
+  } while (0)
+
+#define log_error(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_WARN, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+
+// Sets the runtime level and starts the writer thread, which is stopped and
+// flushed at exit. Until then messages are written by the caller.
+void log_init(int level);
+// Writes out what is waiting and stops the writer thread
+void log_shutdown();
+// "error", "warn", "info" or "debug" as a level, or -1
+int log_level_from_name(const char *name);
+
+void log_write(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,154 @@
+#include "matchlog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_RECORD_SIZE (1 + 5 * 2 + SIM_MAX_WORMS) // Largest record encoded
+
+// Grows the log so one more record of up to MAX_RECORD_SIZE fits, and
+// returns a writer for the free space
+static ByteWriter log_writer(MatchLog *log) {
+  if (log->size + MAX_RECORD_SIZE > log->capacity) {
+    size_t capacity = log->capacity ? log->capacity * 2 : 4096;
+    uint8_t *data = realloc(log->data, capacity);
+    if (data != NULL) {
+      log->data = data;
+      log->capacity = capacity;
+    }
+  }
+  ByteWriter writer = {log->data + log->size, log->capacity - log->size, 0,
+                       false};
+  return writer;
+}
+
+// Keeps what the writer put, unless it ran out of room (realloc failed)
+static void log_commit(MatchLog *log, const ByteWriter *writer) {
+  if (!writer->overflow) {
+    log->size += writer->offset;
+  }
+}
+
+static void flush_repeat(MatchLog *log) {
+  if (log->repeat == 0) {
+    return;
+  }
+  ByteWriter writer = log_writer(log);
+  put_u8(&writer, LOG_REPEAT);
+  put_varint(&writer, log->repeat);
+  log_commit(log, &writer);
+  log->repeat = 0;
+}
+
+void match_log_free(MatchLog *log) {
+  free(log->data);
+  memset(log, 0, sizeof(*log));
+}
+
+void match_log_start(MatchLog *log, uint32_t seed, int tick_rate) {
+  log->size = 0;
+  log->ticks = 0;
+  log->num_inputs = -1; // Nothing to repeat yet
+  log->repeat = 0;
+  ByteWriter writer = log_writer(log);
+  for (int i = 0; i < LOG_MAGIC_SIZE; i++) {
+    put_u8(&writer, LOG_MAGIC[i]);
+  }
+  put_u8(&writer, LOG_START);
+  put_varint(&writer, seed);
+  put_varint(&writer, tick_rate);
+  log_commit(log, &writer);
+}
+
+void match_log_join(MatchLog *log) {
+  flush_repeat(log);
+  log->num_inputs = -1;
+  ByteWriter writer = log_writer(log);
+  put_u8(&writer, LOG_JOIN);
+  log_commit(log, &writer);
+}
+
+void match_log_leave(MatchLog *log, int index) {
+  flush_repeat(log);
+  log->num_inputs = -1;
+  ByteWriter writer = log_writer(log);
+  put_u8(&writer, LOG_LEAVE);
+  put_varint(&writer, index);
+  log_commit(log, &writer);
+}
+
+void match_log_tick(MatchLog *log, const uint8_t *inputs, int num_worms) {
+  log->ticks++;
+  if (num_worms == log->num_inputs &&
+      memcmp(inputs, log->inputs, num_worms) == 0) {
+    log->repeat++;
+    return;
+  }
+  flush_repeat(log);
+  ByteWriter writer = log_writer(log);
+  put_u8(&writer, LOG_TICK);
+  for (int i = 0; i < num_worms; i++) {
+    put_u8(&writer, inputs[i]);
+  }
+  log_commit(log, &writer);
+  memcpy(log->inputs, inputs, num_worms);
+  log->num_inputs = num_worms;
+}
+
+void match_log_check(MatchLog *log, uint32_t hash) {
+  flush_repeat(log);
+  ByteWriter writer = log_writer(log);
+  put_u8(&writer, LOG_CHECK);
+  put_varint(&writer, hash);
+  log_commit(log, &writer);
+}
+
+bool match_log_save(MatchLog *log, const char *path) {
+  flush_repeat(log);
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    perror("Opening match log failed");
+    return false;
+  }
+  bool ok = fwrite(log->data, 1, log->size, file) == log->size;
+  if (fclose(file) != 0 || !ok) {
+    perror("Writing match log failed");
+    return false;
+  }
+  return true;
+}
+
+bool match_log_next(ByteReader *reader, int num_worms, LogRecord *record) {
+  if (reader->offset >= reader->size) {
+    return false;
+  }
+  record->type = get_u8(reader);
+  switch (record->type) {
+  case LOG_START:
+    record->seed = get_varint(reader);
+    record->tick_rate = get_varint(reader);
+    break;
+  case LOG_JOIN:
+    break;
+  case LOG_LEAVE:
+    record->index = get_varint(reader);
+    if (record->index >= num_worms) {
+      return false;
+    }
+    break;
+  case LOG_TICK:
+    for (int i = 0; i < num_worms; i++) {
+      record->inputs[i] = get_u8(reader);
+    }
+    break;
+  case LOG_REPEAT:
+    record->count = get_varint(reader);
+    break;
+  case LOG_CHECK:
+    record->hash = get_varint(reader);
+    break;
+  default:
+    return false;
+  }
+  return !reader->error;
+}
@@ -0,0 +1,71 @@
+#ifndef MATCHLOG_H
+#define MATCHLOG_H
+
+#include "protocol.h"
+#include "sim.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A match log holds everything that drives a Sim, so replaying it through
+// the same calls plays out the same game. It is LOG_MAGIC followed by
+// records, each a type byte and varint fields:
+//   LOG_START seed tick_rate  sim_init / sim_reset with this seed
+//   LOG_JOIN                  sim_add_worm
+//   LOG_LEAVE index           sim_remove_worm
+//   LOG_TICK bits...          sim_step, one byte of SIM_INPUT_* per worm
+//   LOG_REPEAT count          count more sim_steps with the same inputs
+//   LOG_CHECK hash            sim_hash after the step before it
+#define LOG_MAGIC "BNL2" // Bumped whenever sim_step's rules change
+#define LOG_MAGIC_SIZE 4
+#define LOG_CHECK_INTERVAL 60 // Ticks between LOG_CHECK records
+
+enum {
+  LOG_START = 1,
+  LOG_JOIN,
+  LOG_LEAVE,
+  LOG_TICK,
+  LOG_REPEAT,
+  LOG_CHECK,
+};
+
+// A log being recorded, in memory. A run of identical ticks is held back
+// as a count and written as one LOG_REPEAT before the next other record.
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+  unsigned long ticks; // sim_steps recorded since match_log_start
+  uint8_t inputs[SIM_MAX_WORMS]; // Of the last LOG_TICK
+  int num_inputs;
+  uint32_t repeat;
+} MatchLog;
+
+// One decoded record. Only the fields of its type are set.
+typedef struct {
+  int type;
+  uint32_t seed;
+  int tick_rate;
+  int index;
+  uint32_t count;
+  uint8_t inputs[SIM_MAX_WORMS];
+  uint32_t hash;
+} LogRecord;
+
+void match_log_free(MatchLog *log);
+// Clears the log and begins it with LOG_MAGIC and a LOG_START
+void match_log_start(MatchLog *log, uint32_t seed, int tick_rate);
+void match_log_join(MatchLog *log);
+void match_log_leave(MatchLog *log, int index);
+void match_log_tick(MatchLog *log, const uint8_t *inputs, int num_worms);
+void match_log_check(MatchLog *log, uint32_t hash);
+// Writes the log to path, completing any pending LOG_REPEAT first
+bool match_log_save(MatchLog *log, const char *path);
+
+// Decodes the record at reader's offset. num_worms is how many worms the
+// replaying Sim has, which is how many bytes a LOG_TICK carries. Returns
+// false at the end of the log or on a malformed record.
+bool match_log_next(ByteReader *reader, int num_worms, LogRecord *record);
+
+#endif
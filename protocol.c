@@ -0,0 +1,337 @@
+#include "protocol.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define PI 3.14159265358979323846
+#define COORD_SCALE (1 << COORD_FRACTION_BITS)
+
+void put_u8(ByteWriter *writer, uint8_t value) {
+  if (writer->offset >= writer->size) {
+    writer->overflow = true;
+    return;
+  }
+  writer->data[writer->offset++] = value;
+}
+
+void put_u16(ByteWriter *writer, uint16_t value) {
+  if (writer->offset + 2 > writer->size) {
+    writer->overflow = true;
+    return;
+  }
+  writer->data[writer->offset++] = value & 0xFF;
+  writer->data[writer->offset++] = value >> 8;
+}
+
+// Eight bytes, little-endian
+void put_u64(ByteWriter *writer, uint64_t value) {
+  for (int shift = 0; shift < 64; shift += 8) {
+    put_u8(writer, (value >> shift) & 0xFF);
+  }
+}
+
+// LEB128: seven bits per byte, high bit set on all but the last byte
+void put_varint(ByteWriter *writer, uint32_t value) {
+  while (value >= 0x80) {
+    put_u8(writer, (value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  put_u8(writer, value);
+}
+
+void put_coord(ByteWriter *writer, float value) {
+  float scaled = value * COORD_SCALE + 0.5f;
+  put_u16(writer, scaled <= 0 ? 0 : (scaled >= 65535 ? 65535 : scaled));
+}
+
+void put_angle(ByteWriter *writer, float value) {
+  double turns = fmod(value / (2 * PI), 1.0);
+  if (turns < 0) {
+    turns += 1.0;
+  }
+  put_u16(writer, (uint16_t)(turns * 65536.0));
+}
+
+void put_duration(ByteWriter *writer, float seconds) {
+  float scaled = seconds * DURATION_SCALE + 0.5f;
+  put_u16(writer, scaled <= 0 ? 0 : (scaled >= 65535 ? 65535 : scaled));
+}
+
+uint8_t get_u8(ByteReader *reader) {
+  if (reader->offset >= reader->size) {
+    reader->error = true;
+    return 0;
+  }
+  return reader->data[reader->offset++];
+}
+
+uint16_t get_u16(ByteReader *reader) {
+  if (reader->offset + 2 > reader->size) {
+    reader->error = true;
+    return 0;
+  }
+  uint16_t value = reader->data[reader->offset] |
+                   (reader->data[reader->offset + 1] << 8);
+  reader->offset += 2;
+  return value;
+}
+
+uint64_t get_u64(ByteReader *reader) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 8) {
+    value |= (uint64_t)get_u8(reader) << shift;
+  }
+  return value;
+}
+
+uint32_t get_varint(ByteReader *reader) {
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    uint8_t byte = get_u8(reader);
+    value |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  reader->error = true;
+  return 0;
+}
+
+float get_coord(ByteReader *reader) {
+  return get_u16(reader) / (float)COORD_SCALE;
+}
+
+float get_angle(ByteReader *reader) {
+  return get_u16(reader) * (float)(2 * PI / 65536.0);
+}
+
+float get_duration(ByteReader *reader) {
+  return get_u16(reader) / (float)DURATION_SCALE;
+}
+
+bool recv_buffer_init(RecvBuffer *buffer, size_t capacity) {
+  buffer->data = malloc(capacity);
+  buffer->capacity = buffer->data != NULL ? capacity : 0;
+  buffer->start = 0;
+  buffer->end = 0;
+  buffer->corrupt = false;
+  return buffer->data != NULL;
+}
+
+void recv_buffer_free(RecvBuffer *buffer) {
+  free(buffer->data);
+  buffer->data = NULL;
+  buffer->capacity = 0;
+}
+
+// Reads whatever the socket has into the buffer. Returns the recv() result,
+// or -1 with errno EMSGSIZE if the peer sent an oversized frame. Pointers
+// returned by recv_buffer_next_frame are invalid afterwards.
+ssize_t recv_buffer_fill(RecvBuffer *buffer, int socket) {
+  if (buffer->corrupt) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  if (buffer->start == buffer->end) {
+    buffer->start = buffer->end = 0;
+  } else if (buffer->start > 0 &&
+             buffer->capacity - buffer->end < buffer->capacity / 4) {
+    memmove(buffer->data, buffer->data + buffer->start,
+            buffer->end - buffer->start);
+    buffer->end -= buffer->start;
+    buffer->start = 0;
+  }
+
+  if (buffer->end == buffer->capacity) {
+    // A single frame larger than the buffer is pending
+    size_t capacity = buffer->capacity * 2;
+    if (capacity > MAX_FRAME_SIZE + FRAME_HEADER_SIZE) {
+      capacity = MAX_FRAME_SIZE + FRAME_HEADER_SIZE;
+    }
+    uint8_t *data = realloc(buffer->data, capacity);
+    if (capacity == buffer->capacity || data == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+
+  ssize_t n = recv(socket, buffer->data + buffer->end,
+                   buffer->capacity - buffer->end, 0);
+  if (n > 0) {
+    buffer->end += n;
+  }
+  return n;
+}
+
+// Returns the payload of the next complete frame and stores its length, or
+// returns NULL if no complete frame has been received yet.
+const uint8_t *recv_buffer_next_frame(RecvBuffer *buffer, size_t *length) {
+  size_t available = buffer->end - buffer->start;
+  if (available < FRAME_HEADER_SIZE) {
+    return NULL;
+  }
+
+  const uint8_t *header = buffer->data + buffer->start;
+  uint32_t payload = header[0] | (header[1] << 8) | (header[2] << 16) |
+                     ((uint32_t)header[3] << 24);
+  if (payload > MAX_FRAME_SIZE) {
+    buffer->corrupt = true;
+    return NULL;
+  }
+  if (available < FRAME_HEADER_SIZE + payload) {
+    return NULL;
+  }
+
+  buffer->start += FRAME_HEADER_SIZE + payload;
+  *length = payload;
+  return header + FRAME_HEADER_SIZE;
+}
+
+void send_queue_init(SendQueue *queue) {
+  queue->data = NULL;
+  queue->capacity = 0;
+  queue->start = 0;
+  queue->end = 0;
+}
+
+void send_queue_free(SendQueue *queue) {
+  free(queue->data);
+  send_queue_init(queue);
+}
+
+// Appends bytes the caller has checked fit under SEND_QUEUE_LIMIT
+static bool send_queue_append(SendQueue *queue, const void *bytes,
+                              size_t length) {
+  if (queue->start > 0) {
+    memmove(queue->data, queue->data + queue->start,
+            queue->end - queue->start);
+    queue->end -= queue->start;
+    queue->start = 0;
+  }
+  if (queue->end + length > queue->capacity) {
+    size_t capacity = queue->capacity ? queue->capacity : 4096;
+    while (capacity < queue->end + length) {
+      capacity *= 2;
+    }
+    uint8_t *data = realloc(queue->data, capacity);
+    if (data == NULL) {
+      return false;
+    }
+    queue->data = data;
+    queue->capacity = capacity;
+  }
+  memcpy(queue->data + queue->end, bytes, length);
+  queue->end += length;
+  return true;
+}
+
+// Sends as much of the queue as the socket takes without blocking. Returns
+// the number of bytes still queued, or -1 if the socket failed.
+ssize_t send_queue_flush(SendQueue *queue, int socket) {
+  while (queue->start < queue->end) {
+    ssize_t sent = send(socket, queue->data + queue->start,
+                        queue->end - queue->start, MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+    queue->start += sent;
+  }
+  if (queue->start == queue->end) {
+    queue->start = queue->end = 0;
+  }
+  return queue->end - queue->start;
+}
+
+// Sends one frame without blocking, queueing whatever the socket does not
+// take behind anything queued before. Returns false if the frame would not
+// fit under SEND_QUEUE_LIMIT, in which case none of it was written, or if the
+// socket failed or memory ran out, after which the stream is unusable.
+bool send_queue_frame(SendQueue *queue, int socket, const void *payload,
+                      size_t length) {
+  uint8_t header[FRAME_HEADER_SIZE] = {length & 0xFF, (length >> 8) & 0xFF,
+                                       (length >> 16) & 0xFF,
+                                       (length >> 24) & 0xFF};
+  ssize_t queued = send_queue_flush(queue, socket);
+  if (queued < 0 ||
+      (size_t)queued + FRAME_HEADER_SIZE + length > SEND_QUEUE_LIMIT) {
+    return false;
+  }
+
+  size_t sent = 0;
+  if (queued == 0) {
+    struct iovec parts[2] = {{header, FRAME_HEADER_SIZE},
+                             {(void *)payload, length}};
+    struct msghdr message = {0};
+    message.msg_iov = parts;
+    message.msg_iovlen = 2;
+    ssize_t n;
+    do {
+      n = sendmsg(socket, &message, MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      return false;
+    }
+    sent = n > 0 ? n : 0;
+  }
+
+  // Whatever follows a partly sent frame must stay in order behind it
+  if (sent < FRAME_HEADER_SIZE &&
+      !send_queue_append(queue, header + sent, FRAME_HEADER_SIZE - sent)) {
+    return false;
+  }
+  size_t payload_sent = sent > FRAME_HEADER_SIZE ? sent - FRAME_HEADER_SIZE : 0;
+  return payload_sent == length ||
+         send_queue_append(queue, (const uint8_t *)payload + payload_sent,
+                           length - payload_sent);
+}
+
+// Sends the header and payload of one frame, retrying partial writes.
+// Returns 0 on success and -1 on error.
+int send_frame(int socket, const void *payload, size_t length) {
+  uint8_t header[FRAME_HEADER_SIZE] = {length & 0xFF, (length >> 8) & 0xFF,
+                                       (length >> 16) & 0xFF,
+                                       (length >> 24) & 0xFF};
+  struct iovec parts[2] = {{header, FRAME_HEADER_SIZE},
+                           {(void *)payload, length}};
+  struct msghdr message = {0};
+  message.msg_iov = parts;
+  message.msg_iovlen = 2;
+
+  while (message.msg_iovlen > 0) {
+    ssize_t sent = sendmsg(socket, &message, 0);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    while (message.msg_iovlen > 0 &&
+           (size_t)sent >= message.msg_iov->iov_len) {
+      sent -= message.msg_iov->iov_len;
+      message.msg_iov++;
+      message.msg_iovlen--;
+    }
+    if (message.msg_iovlen > 0) {
+      message.msg_iov->iov_base = (uint8_t *)message.msg_iov->iov_base + sent;
+      message.msg_iov->iov_len -= sent;
+    }
+  }
+  return 0;
+}
+
+int send_message(int socket, const char *text) {
+  return send_frame(socket, text, strlen(text) + 1);
+}
@@ -0,0 +1,116 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Binary STATE messages start with PROTOCOL_MAGIC, which no text message
+// does, followed by PROTOCOL_VERSION.
+#define PROTOCOL_MAGIC 0xB5
+#define PROTOCOL_VERSION 2
+#define COORD_FRACTION_BITS 5 // 1/32 px, covers 0..2047 px in 16 bits
+#define DURATION_SCALE 1000.0 // Durations are sent in milliseconds
+
+// Flag bits of a worm record in a binary STATE
+#define WORM_FLAG_ALIVE 0x01
+#define WORM_FLAG_BOOST 0x02
+#define WORM_FLAG_GHOST 0x04
+#define WORM_FLAG_BULLET_SHIFT 3 // One bit per bullet slot from here on
+
+// Each worm record carries the sequence number of its client's INPUT that the
+// tick used, so the client can tell which of its predicted inputs the
+// server has applied. TCP INPUT messages are "INPUT <left> <right> <up>
+// <sequence>", the sequence being optional. A joining client is told the
+// server's simulation rate as "TICK_RATE <hz>" before its PLAYER_ID, so it
+// can predict at that rate.
+
+// Real-time traffic goes over UDP once the client has its token, sent on TCP
+// as "UDP_TOKEN <connection id> <nonce>", the nonce a random 64-bit number.
+// Client datagrams are UDP_INPUT, varint connection id, the nonce as 8
+// little-endian bytes, varint input sequence, a byte of INPUT_* bits and the
+// varint sequence of the last STATE applied. Server datagrams are a STATE
+// exactly as it would be framed on TCP; snapshots that do not fit in
+// UDP_MAX_PAYLOAD go over TCP instead.
+#define UDP_INPUT 0x49
+#define INPUT_LEFT 0x01
+#define INPUT_RIGHT 0x02
+#define INPUT_UP 0x04
+#define UDP_MAX_PAYLOAD 1200
+
+// Every TCP message is a frame: a 4-byte little-endian payload length, then
+// the payload. Text messages include their NUL terminator in the payload so
+// they can be parsed where they lie in the receive buffer.
+#define FRAME_HEADER_SIZE 4
+#define MAX_FRAME_SIZE (1 << 20)
+
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t offset;
+  bool overflow; // Set once a put did not fit; later puts are dropped
+} ByteWriter;
+
+// Receive buffer for one connection. Complete frames are handed out as
+// pointers into it; only a trailing partial frame is ever moved, to the
+// front, to make room for the next recv().
+typedef struct {
+  uint8_t *data;
+  size_t capacity;
+  size_t start; // First byte not yet handed out
+  size_t end;   // One past the last byte received
+  bool corrupt; // A frame header exceeded MAX_FRAME_SIZE
+} RecvBuffer;
+
+// Outbound bytes for one non-blocking socket that send() could not take
+// yet, oldest first. Only whole frames are ever refused, and the queue never
+// holds more than SEND_QUEUE_LIMIT bytes, so a peer that stops reading costs
+// that much memory and no waiting.
+#define SEND_QUEUE_LIMIT (MAX_FRAME_SIZE + FRAME_HEADER_SIZE)
+
+typedef struct {
+  uint8_t *data;
+  size_t capacity;
+  size_t start; // First byte not yet sent
+  size_t end;   // One past the last byte queued
+} SendQueue;
+
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  size_t offset;
+  bool error; // Set once a get ran past the end; later gets return 0
+} ByteReader;
+
+void put_u8(ByteWriter *writer, uint8_t value);
+void put_u16(ByteWriter *writer, uint16_t value);
+void put_u64(ByteWriter *writer, uint64_t value);
+void put_varint(ByteWriter *writer, uint32_t value);
+void put_coord(ByteWriter *writer, float value);
+void put_angle(ByteWriter *writer, float value);
+void put_duration(ByteWriter *writer, float seconds);
+
+uint8_t get_u8(ByteReader *reader);
+uint16_t get_u16(ByteReader *reader);
+uint64_t get_u64(ByteReader *reader);
+uint32_t get_varint(ByteReader *reader);
+float get_coord(ByteReader *reader);
+float get_angle(ByteReader *reader);
+float get_duration(ByteReader *reader);
+
+bool recv_buffer_init(RecvBuffer *buffer, size_t capacity);
+void recv_buffer_free(RecvBuffer *buffer);
+ssize_t recv_buffer_fill(RecvBuffer *buffer, int socket);
+const uint8_t *recv_buffer_next_frame(RecvBuffer *buffer, size_t *length);
+
+void send_queue_init(SendQueue *queue);
+void send_queue_free(SendQueue *queue);
+ssize_t send_queue_flush(SendQueue *queue, int socket);
+bool send_queue_frame(SendQueue *queue, int socket, const void *payload,
+                      size_t length);
+
+int send_frame(int socket, const void *payload, size_t length);
+int send_message(int socket, const char *text);
+
+#endif
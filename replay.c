@@ -0,0 +1,229 @@
+// Replays a match log recorded by `server --record DIR` through the sim as
+// fast as the CPU allows, checking the sim_hash records along the way.
+// Prints one JSON object with the time each tick took; exits 1 if the
+// replay diverged from the recording or the log is malformed.
+//
+// --repeat N plays the log N times, for a longer profiling workload.
+// --stop-at TICK stops just before that tick, to break on a slow one.
+// --verbose logs the sim's kills, pickups and shots.
+#define _DEFAULT_SOURCE // clock_gettime under -std=c11 on glibc
+#include "log.h"
+#include "matchlog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+  unsigned long ticks;
+  unsigned long checks;
+  unsigned long mismatches;
+  unsigned long first_mismatch_tick;
+  int max_worms;
+  uint32_t final_hash;
+  int64_t *tick_ns; // One per tick, in order
+  size_t tick_capacity;
+} Replay;
+
+static int64_t monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint8_t *read_file(const char *path, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t *data = malloc(length > 0 ? length : 1);
+  if (data == NULL || fread(data, 1, length, file) != (size_t)length) {
+    fprintf(stderr, "Reading %s failed\n", path);
+    free(data);
+    fclose(file);
+    return NULL;
+  }
+  fclose(file);
+  *size = length;
+  return data;
+}
+
+static void step(Sim *sim, const uint8_t *inputs, Replay *replay) {
+  if (replay->ticks == replay->tick_capacity) {
+    replay->tick_capacity =
+        replay->tick_capacity ? replay->tick_capacity * 2 : 4096;
+    replay->tick_ns = realloc(replay->tick_ns,
+                              replay->tick_capacity * sizeof(int64_t));
+  }
+  int64_t start = monotonic_ns();
+  sim_step(sim, inputs);
+  replay->tick_ns[replay->ticks++] = monotonic_ns() - start;
+  if (sim->num_worms > replay->max_worms) {
+    replay->max_worms = sim->num_worms;
+  }
+}
+
+// Plays the log once into sim. Returns false if it is malformed.
+static bool play(const uint8_t *data, size_t size, Sim *sim, Replay *replay,
+                 unsigned long stop_at) {
+  if (size < LOG_MAGIC_SIZE || memcmp(data, LOG_MAGIC, LOG_MAGIC_SIZE) != 0) {
+    if (size >= LOG_MAGIC_SIZE && memcmp(data, LOG_MAGIC, 3) == 0) {
+      fprintf(stderr, "Match log of other game rules (%.4s, not %s)\n",
+              (const char *)data, LOG_MAGIC);
+    } else {
+      fprintf(stderr, "Not a match log\n");
+    }
+    return false;
+  }
+  ByteReader reader = {data, size, LOG_MAGIC_SIZE, false};
+  LogRecord record;
+  uint8_t inputs[SIM_MAX_WORMS] = {0};
+  bool started = false;
+
+  while (match_log_next(&reader, sim->num_worms, &record)) {
+    if (record.type != LOG_START && !started) {
+      break;
+    }
+    switch (record.type) {
+    case LOG_START:
+      sim_free(sim);
+      sim_init(sim, record.seed, record.tick_rate);
+      started = true;
+      break;
+    case LOG_JOIN:
+      if (sim_add_worm(sim) < 0) {
+        fprintf(stderr, "Join beyond SIM_MAX_WORMS\n");
+        return false;
+      }
+      break;
+    case LOG_LEAVE:
+      sim_remove_worm(sim, record.index);
+      break;
+    case LOG_TICK:
+      memcpy(inputs, record.inputs, sizeof(inputs));
+      if (sim->current_tick + 1 >= stop_at) {
+        return true;
+      }
+      step(sim, inputs, replay);
+      break;
+    case LOG_REPEAT:
+      for (uint32_t i = 0; i < record.count; i++) {
+        if (sim->current_tick + 1 >= stop_at) {
+          return true;
+        }
+        step(sim, inputs, replay);
+      }
+      break;
+    case LOG_CHECK:
+      replay->checks++;
+      if (sim_hash(sim) != record.hash) {
+        if (replay->mismatches++ == 0) {
+          replay->first_mismatch_tick = sim->current_tick;
+        }
+      }
+      break;
+    }
+  }
+  if (reader.offset != size) {
+    fprintf(stderr, "Malformed record at offset %zu\n", reader.offset);
+    return false;
+  }
+  replay->final_hash = sim_hash(sim);
+  return true;
+}
+
+static int compare_ns(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void usage(const char *program) {
+  fprintf(stderr, "Usage: %s LOG [--repeat N] [--stop-at TICK] [--verbose]\n",
+          program);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = NULL;
+  int repeat = 1;
+  unsigned long stop_at = (unsigned long)-1;
+  bool verbose = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+      repeat = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--stop-at") == 0 && i + 1 < argc) {
+      stop_at = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--verbose") == 0) {
+      verbose = true;
+    } else if (path == NULL && argv[i][0] != '-') {
+      path = argv[i];
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (path == NULL || repeat <= 0) {
+    usage(argv[0]);
+  }
+  // No log_init: the messages are written as they happen, as a replay
+  // logs faster than a ring drains and --verbose wants every line
+  log_level = verbose ? LOG_DEBUG : LOG_INFO;
+
+  size_t size;
+  uint8_t *data = read_file(path, &size);
+  if (data == NULL) {
+    return 1;
+  }
+
+  Replay replay = {0};
+  Sim sim;
+  memset(&sim, 0, sizeof(sim));
+  int64_t start = monotonic_ns();
+  for (int r = 0; r < repeat; r++) {
+    if (!play(data, size, &sim, &replay, stop_at)) {
+      return 1;
+    }
+  }
+  int64_t elapsed = monotonic_ns() - start;
+  int tick_rate = sim.tick_rate > 0 ? sim.tick_rate : DEFAULT_TICK_RATE;
+  sim_free(&sim);
+
+  // The slowest tick of the first play is the one to --stop-at
+  unsigned long ticks_per_play = replay.ticks / repeat;
+  unsigned long slowest = 0;
+  for (unsigned long i = 1; i < ticks_per_play; i++) {
+    if (replay.tick_ns[i] > replay.tick_ns[slowest]) {
+      slowest = i;
+    }
+  }
+  double seconds = elapsed / 1e9;
+  printf("{\n  \"log\": \"%s\", \"bytes\": %zu, \"repeat\": %d,\n"
+         "  \"ticks\": %lu, \"max_worms\": %d, \"seconds\": %.3f,\n"
+         "  \"ticks_per_s\": %.0f, \"realtime_factor\": %.1f,\n",
+         path, size, repeat, replay.ticks, replay.max_worms, seconds,
+         replay.ticks / seconds, replay.ticks / (double)tick_rate / seconds);
+  if (replay.ticks > 0) {
+    int64_t slowest_ns = replay.tick_ns[slowest];
+    qsort(replay.tick_ns, replay.ticks, sizeof(int64_t), compare_ns);
+    printf("  \"tick_ns\": {\"p50\": %lld, \"p99\": %lld, \"max\": %lld},\n"
+           "  \"slowest_tick\": %lu, \"slowest_tick_ns\": %lld,\n",
+           (long long)replay.tick_ns[replay.ticks / 2],
+           (long long)replay.tick_ns[replay.ticks * 99 / 100],
+           (long long)replay.tick_ns[replay.ticks - 1], slowest + 1,
+           (long long)slowest_ns);
+  }
+  printf("  \"checks\": %lu, \"mismatches\": %lu", replay.checks,
+         replay.mismatches);
+  if (replay.mismatches > 0) {
+    printf(", \"first_mismatch_tick\": %lu", replay.first_mismatch_tick);
+  }
+  printf(", \"final_hash\": \"%08x\"\n}\n", replay.final_hash);
+
+  free(replay.tick_ns);
+  free(data);
+  return replay.mismatches > 0 ? 1 : 0;
+}
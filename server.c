@@ -1,563 +1,1268 @@
-#include "SDL_stdinc.h"
+#define _DEFAULT_SOURCE // clock_nanosleep and friends under -std=c11 on glibc
+#include "log.h"
+#include "matchlog.h"
+#include "protocol.h"
+#include "sim.h"
+#include "state.h"
+#include "stats.h"
 #include <arpa/inet.h>
-#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/random.h>
+#endif
 #include <time.h>
 #include <unistd.h>
-
-#define MAX_CLIENTS 6
-#define SCREEN_WIDTH (int)(1024 * 1.2)
-#define SCREEN_HEIGHT (int)(640 * 1.2)
-#define WORM_SPEED 2.0
-#define SPEED_BOOST_MULTIPLIER 3
-#define TURN_SPEED 0.1
-#define WORM_RADIUS 3
-#define INPUT_BUFFER_SIZE 10
-#define PI 3.14159265
-#define MAX_BULLETS 3
-#define BULLET_SPEED 12
-#define POWERUP_SPAWN_INTERVAL 5
-#define MAX_POWERUPS 3
-#define SPAWN_CIRCLE_RADIUS 50
-#define POWERUP_RADIUS 10
-#define BULLET_RADIUS 5
-#define TAIL_COLLISION_THRESHOLD 10
-#define INVINCIIBILITY_TIME 2
-#define SPEED_BOOST_DURATION 3.0
-#define BULLET_COOLDOWN 0.003
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#define MAX_CLIENTS SIM_MAX_WORMS // Per match
+#define MAX_MATCHES 256
+#define MAX_CATCHUP_TICKS 5  // Further behind than this, ticks are dropped
+#define TICK_REPORT_INTERVAL 10 // Seconds between tick overrun reports
+#define SNAPSHOT_HISTORY 64
+#define STATE_BUFFER_SIZE (16384 * 16)
+#define CLIENT_RECV_BUFFER_SIZE 512 // Grows for larger frames
+#define MAX_EVENTS 64
+#define STATS_SOCKET_PATH "/tmp/battle_noodles_server.sock"
+#define STATS_BUFFER_SIZE 8192
 
 #define DISCOVERY_PORT 8081
 #define GAME_PORT 8080
 #define SERVER_NAME "BattleNoodles_Server"
 
+// Written by one worker and read by the reactor for stats and on shutdown,
+// so each field is an atomic. They are independent counters, read with
+// STAT_LOAD and written with STAT_ADD and STAT_STORE in relaxed order.
 typedef struct {
-  float x;
-  float y;
-} Point;
-
+  _Atomic unsigned long ticks;    // Scheduler ticks elapsed
+  _Atomic unsigned long overruns; // Ticks that ended after the next deadline
+  _Atomic unsigned long dropped;  // Ticks skipped to get back on schedule
+  _Atomic int64_t max_lateness_ns;
+} TickStats;
+
+#define STAT_LOAD(field) atomic_load_explicit(&(field), memory_order_relaxed)
+#define STAT_ADD(field, n)                                                     \
+  atomic_fetch_add_explicit(&(field), (n), memory_order_relaxed)
+#define STAT_STORE(field, value)                                               \
+  atomic_store_explicit(&(field), (value), memory_order_relaxed)
+
+// What each worker keeps a rolling histogram of (stats.h). The worker
+// records the tick phases, per match ticked, and the round covering all of
+// its matches; its broadcaster records encoding and sending, per match.
+typedef enum {
+  METRIC_LOCK,     // Waiting for the match mutex, ns
+  METRIC_POWERUPS, // sim_advance, ns
+  METRIC_WORMS,    // sim_update_worms, ns
+  METRIC_CAPTURE,  // The match log, capture_snapshot and history, ns
+  METRIC_ROUND,    // Every match of the worker, ns
+  METRIC_ENCODE,   // Building the STATE messages, ns
+  METRIC_SEND,     // send_mutex wait and every non-blocking send, ns
+  METRIC_BYTES_ENCODED,
+  METRIC_BYTES_SENT,
+  NUM_METRICS
+} Metric;
+
+const char *metric_names[NUM_METRICS] = {
+    "lock_ns",   "powerups_ns", "worms_ns",      "capture_ns", "round_ns",
+    "encode_ns", "send_ns",     "bytes_encoded", "bytes_sent"};
+
+// A client's input mailbox packs the INPUT_* bits (protocol.h) below the
+// sequence number the client tagged them with, so one atomic word carries
+// both and the tick never takes a lock to read it. Only the reactor thread
+// publishes.
+#define INPUT_BITS_MASK 0x07
+#define INPUT_SEQ_SHIFT 3
+
+_Static_assert(INPUT_LEFT == SIM_INPUT_LEFT && INPUT_RIGHT == SIM_INPUT_RIGHT &&
+                   INPUT_UP == SIM_INPUT_UP,
+               "wire input bits are passed straight to sim_step");
+
+// Client i of a match plays sim.worms[i]
 typedef struct {
-  Point position;
-  float angle;
-  bool active;
-} Bullet;
-
-typedef enum { POWERUP_BULLETS, POWERUP_SPEED, POWERUP_GHOST } PowerupType;
+  int socket;
+  _Atomic uint32_t input; // Sequence << INPUT_SEQ_SHIFT | INPUT_* bits
+  unsigned int acked_seq; // Last STATE the client applied, 0 for none
+  uint64_t udp_nonce;     // Proves a datagram comes from this client
+  bool udp_ready;         // udp_addr is known, snapshots may go over UDP
+  struct sockaddr_in udp_addr;
+  struct in_addr peer_addr; // The TCP peer; udp_addr only moves within it
+  uint32_t last_input_seq; // Older UDP inputs arrived out of order
+  uint32_t applied_input_seq; // Sequence of the input the last tick used
+  SendQueue out; // What the socket has not taken yet, under send_mutex
+} Client;
 
+// What went out in one STATE message, kept so a delta can be built against
+// whichever snapshot a client last acknowledged.
 typedef struct {
-  Point position;
-  PowerupType type;
-  bool active;
-} Powerup;
+  unsigned int seq;
+  int num_worms;
+  unsigned int worm_ids[MAX_CLIENTS];
+  int path_lengths[MAX_CLIENTS];
+} SnapshotRecord;
 
 typedef struct {
-  bool left;
-  bool right;
-  bool up;
-} InputState;
-
+  int socket;
+  bool udp_ready;
+  struct sockaddr_in udp_addr;
+  int path_starts[MAX_CLIENTS]; // path_delta_start for each worm
+} Recipient;
+
+// Everything needed to encode and send one tick's STATE, captured under the
+// match mutex and immutable afterwards. A snapshot has one owner at a time:
+// the worker that captured it until it goes into the match's pending slot,
+// then whoever exchanges it out of the slot, who frees it with
+// snapshot_free. Nothing else ever points at it.
 typedef struct {
-  Point position;
-  float angle;
-  bool alive;
-  InputState input;
-  pthread_mutex_t input_mutex;
-  Point *path; // Change to a pointer
-  int path_length;
-  int path_capacity; // Add this to keep track of allocated memory
-  int bullets_left;
-  Bullet bullets[MAX_BULLETS];
-  time_t invincibility_end;
-  float speed_boost_time_left;
-  bool speed_boost_active;
-  float last_shot_time;
-  bool is_ghost;
-} Worm;
-
+  unsigned int epoch; // Match membership_epoch when captured
+  WorldState world;   // world.num_worms is also the number of recipients
+  Recipient recipients[MAX_CLIENTS];
+  Point *points; // Backing store for every world.worms[i].points
+} Snapshot;
+
+// One game room. Everything a match touches lives here and is guarded by its
+// mutex; matches never look at each other.
 typedef struct {
-  int socket;
-  Worm worm;
-} Client;
-
-Client clients[MAX_CLIENTS];
-int num_clients = 0;
-bool game_started = false;
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-Powerup powerups[MAX_POWERUPS];
-int active_powerups = 0;
-time_t last_powerup_spawn = 0;
+  int id;
+  pthread_mutex_t mutex;
+  Client clients[MAX_CLIENTS];
+  int num_clients; // Always sim.num_worms
+  bool game_started;
+  Sim sim;
+  MatchLog log; // Every call that drove sim this game, with --record
+  SnapshotRecord snapshot_history[SNAPSHOT_HISTORY];
+  unsigned int snapshot_seq;
+  // One-slot mailbox from the worker to its broadcaster: the newest
+  // snapshot not yet broadcast, replacing any the broadcaster missed
+  _Atomic(Snapshot *) pending;
+  // Writes to and closes of member sockets, and their send queues. Joins and
+  // leaves bump membership_epoch holding both mutexes, so a broadcast holding
+  // only this one can tell its recipient list has gone stale. Nothing done
+  // under it waits for a peer: sockets are non-blocking and what they do not
+  // take goes to the client's send queue.
+  pthread_mutex_t send_mutex;
+  unsigned int membership_epoch;
+} Match;
+
+// Per-socket network state, indexed by file descriptor
+typedef struct {
+  bool open;
+  RecvBuffer buffer;
+  Match *match; // NULL until the connection has joined
+  int slot;     // Index into match->clients[]
+  bool watching_writable; // The reactor reports when the socket takes more
+  SendQueue out; // Replies to a connection that has not joined a match
+  bool closing;  // Close once out is flushed; ignore what the peer sends
+} Connection;
+
+// A worker ticks its matches; its broadcaster encodes and sends what each
+// tick published, overlapping with the next tick.
+typedef struct {
+  pthread_t thread;
+  pthread_t broadcaster;
+  int index;
+  TickStats stats;
+  Histogram *metrics; // NUM_METRICS of them, indexed by Metric
+  pthread_mutex_t wake_mutex;
+  pthread_cond_t wake;
+  unsigned long generation; // Bumped after every round of ticks
+  _Atomic unsigned long dropped_frames; // TCP STATEs a full queue refused
+} Worker;
+
+Match matches[MAX_MATCHES];
+int tick_rate = DEFAULT_TICK_RATE;
+int num_workers = 0; // 0: one per online CPU
+Worker *workers = NULL;
+bool text_protocol = false; // --text-protocol: human-readable STATE
+const char *stats_socket_path = STATS_SOCKET_PATH; // --stats-socket, "" off
+int64_t start_ns = 0;
+const char *record_dir = NULL; // --record: a match log per game goes here
+const char *log_level_name = "info"; // --log-level: error, warn, info, debug
+unsigned long recordings = 0;
+int udp_socket = -1;        // STATE and INPUT datagrams, on GAME_PORT
+Connection *connections = NULL;
+int connections_capacity = 0;
+int shutdown_pipe[2] = {-1, -1}; // SIGINT wakes the reactor through this
+
+int64_t monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-void cleanupWorm(Worm *worm) {
-  free(worm->path);
-  pthread_mutex_destroy(&worm->input_mutex);
+// Writes a finished match log to record_dir if it recorded any ticks, then
+// frees it. Callers hand the log over after dropping match->mutex, so a slow
+// disk never holds up the match's worker.
+void save_match_log(MatchLog *log, int match_id) {
+  if (record_dir != NULL && log->ticks > 0) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/match-%ld-%d-%lu.bnl", record_dir,
+             (long)time(NULL), match_id, recordings++);
+    if (match_log_save(log, path)) {
+      log_info("Recorded %lu ticks of match %d to %s", log->ticks, match_id,
+               path);
+    }
+  }
+  match_log_free(log);
 }
 
 void cleanup_game() {
-  pthread_mutex_lock(&clients_mutex);
-  for (int i = 0; i < num_clients; i++) {
-    cleanupWorm(&clients[i].worm);
-  }
-  num_clients = 0;
-  pthread_mutex_unlock(&clients_mutex);
-}
-
-void initWorm(Worm *worm, float startX, float startY, float angle) {
-  worm->position.x = startX;
-  worm->position.y = startY;
-  worm->angle = angle;
-  worm->alive = true;
-  pthread_mutex_init(&worm->input_mutex, NULL);
-  worm->path_capacity = 100; // Start with space for 100 points
-  worm->path = malloc(worm->path_capacity * sizeof(Point));
-  worm->path[0] = (Point){startX, startY};
-  worm->path_length = 1;
-  worm->bullets_left = 0;
-  for (int i = 0; i < MAX_BULLETS; i++) {
-    worm->bullets[i].active = false;
-  }
-  worm->invincibility_end = time(NULL) + INVINCIIBILITY_TIME;
-  worm->speed_boost_time_left = 0;
-  worm->speed_boost_active = false;
-  worm->input.left = false;
-  worm->input.right = false;
-  worm->input.up = false;
-  worm->last_shot_time = 0;
-  memset(&worm->input, 0, sizeof(InputState));
-}
-
-void addPointToPath(Worm *worm, Point newPoint) {
-  if (worm->path_length >= worm->path_capacity) {
-    worm->path_capacity *= 2; // Double the capacity
-    worm->path = realloc(worm->path, worm->path_capacity * sizeof(Point));
-  }
-  worm->path[worm->path_length++] = newPoint;
-}
-
-bool checkTailCollision(Worm *worm, Point newPosition) {
-  int start = (worm->path_length > TAIL_COLLISION_THRESHOLD)
-                  ? worm->path_length - TAIL_COLLISION_THRESHOLD
-                  : 0;
-
-  for (int i = 0; i < start; i++) {
-    float dx = newPosition.x - worm->path[i].x;
-    float dy = newPosition.y - worm->path[i].y;
-    float distance = sqrt(dx * dx + dy * dy);
-    if (distance < WORM_RADIUS * 2) {
-      return true;
-    }
+  for (int m = 0; m < MAX_MATCHES; m++) {
+    Match *match = &matches[m];
+    pthread_mutex_lock(&match->mutex);
+    MatchLog finished = match->log;
+    memset(&match->log, 0, sizeof(match->log));
+    sim_free(&match->sim);
+    match->num_clients = 0;
+    pthread_mutex_unlock(&match->mutex);
+    save_match_log(&finished, match->id);
   }
-  return false;
 }
 
-bool checkCollision(Worm *worm, Point newPosition) {
-  if (time(NULL) < worm->invincibility_end) {
+// Fills value from the kernel's CSPRNG. UDP nonces must not be guessable
+// off-path, or anyone could redirect a client's snapshots.
+bool random_u64(uint64_t *value) {
+#ifdef __linux__
+  return getrandom(value, sizeof(*value), 0) == (ssize_t)sizeof(*value);
+#else
+  FILE *urandom = fopen("/dev/urandom", "rb");
+  if (urandom == NULL) {
     return false;
   }
+  bool ok = fread(value, sizeof(*value), 1, urandom) == 1;
+  fclose(urandom);
+  return ok;
+#endif
+}
+
+void snapshot_free(Snapshot *snapshot) {
+  free(snapshot->points);
+  free(snapshot);
+}
 
-  if (checkTailCollision(worm, newPosition)) {
-    return true;
+// Returns a match to the lobby once its last client has left. The game's log
+// moves to finished for the caller to save once it has dropped match->mutex.
+void reset_match(Match *match, MatchLog *finished) {
+  Snapshot *pending = atomic_exchange(&match->pending, NULL);
+  if (pending != NULL) {
+    snapshot_free(pending);
   }
+  match->game_started = false;
+  match->snapshot_seq = 0;
+  memset(match->snapshot_history, 0, sizeof(match->snapshot_history));
+  *finished = match->log;
+  memset(&match->log, 0, sizeof(match->log));
+  uint64_t random;
+  uint32_t seed = random_u64(&random) ? (uint32_t)random
+                                      : (uint32_t)time(NULL) ^ match->id;
+  sim_reset(&match->sim, seed);
+  if (record_dir != NULL) {
+    match_log_start(&match->log, seed, tick_rate);
+  }
+}
 
-  // Check collision with other worms
-  for (int i = 0; i < num_clients; i++) {
-    Worm *otherWorm = &clients[i].worm;
-    if (otherWorm == worm || !otherWorm->alive)
-      continue;
+// Release pairs with the acquire in game_tick: the tick sees either the
+// previous input or this one, never a mix. Untagged inputs (seq 0) get the
+// next number after the previous one.
+void publish_input(Client *client, uint8_t bits, uint32_t seq) {
+  if (seq == 0) {
+    uint32_t old = atomic_load_explicit(&client->input, memory_order_relaxed);
+    seq = (old >> INPUT_SEQ_SHIFT) + 1;
+  }
+  atomic_store_explicit(&client->input,
+                        (seq << INPUT_SEQ_SHIFT) | (bits & INPUT_BITS_MASK),
+                        memory_order_release);
+}
 
-    for (int j = 0; j < otherWorm->path_length; j++) {
-      float dx = newPosition.x - otherWorm->path[j].x;
-      float dy = newPosition.y - otherWorm->path[j].y;
-      float distance = sqrt(dx * dx + dy * dy);
-      if (distance < WORM_RADIUS * 2) {
-        return true;
+// Picks the match a joining connection goes to: the first one still in
+// its lobby with a free slot, otherwise an empty one. Only the reactor
+// thread changes num_clients and game_started, so no lock is needed to look.
+Match *find_open_match() {
+  Match *empty = NULL;
+  for (int m = 0; m < MAX_MATCHES; m++) {
+    Match *match = &matches[m];
+    if (match->num_clients == 0) {
+      if (empty == NULL) {
+        empty = match;
       }
+    } else if (!match->game_started && match->num_clients < MAX_CLIENTS) {
+      return match;
     }
   }
-  return false;
+  return empty;
 }
 
-void spawnPowerup() {
-  if (active_powerups < MAX_POWERUPS) {
-    Powerup new_powerup;
-    new_powerup.position.x = rand() % SCREEN_WIDTH;
-    new_powerup.position.y = rand() % SCREEN_HEIGHT;
-    new_powerup.active = true;
-    Uint8 new_type = rand() % 3;
-    if (new_type == POWERUP_BULLETS) {
-      new_powerup.type = POWERUP_BULLETS;
-    } else if (new_type == POWERUP_SPEED) {
-      new_powerup.type = POWERUP_SPEED;
-    } else {
-      new_powerup.type = POWERUP_GHOST;
-    }
-    powerups[active_powerups++] = new_powerup;
-    printf("Spawned powerup of type: %d at position (%.2f, %.2f)\n",
-           new_powerup.type, new_powerup.position.x, new_powerup.position.y);
+void watch_writable(int fd, bool writable);
+
+// Sends a control message to a member of match, on the reactor thread with
+// send_mutex held. A peer too far behind to take it is shut down; the
+// reactor closes it once it reads the hangup.
+void send_control(Client *client, const char *text) {
+  if (!send_queue_frame(&client->out, client->socket, text, strlen(text) + 1)) {
+    log_info("Closing client %d: send failed or queue full", client->socket);
+    shutdown(client->socket, SHUT_RDWR);
+  } else if (client->out.start != client->out.end) {
+    watch_writable(client->socket, true);
   }
 }
 
-void updateBullets(Worm *worm) {
-  for (int i = 0; i < MAX_BULLETS; i++) {
-    if (worm->bullets[i].active) {
-      worm->bullets[i].position.x += cos(worm->bullets[i].angle) * BULLET_SPEED;
-      worm->bullets[i].position.y += sin(worm->bullets[i].angle) * BULLET_SPEED;
+// Handles one message from a client. Returns false if the connection should
+// be closed.
+bool handle_message(int client_socket, const char *buffer) {
+  Connection *connection = &connections[client_socket];
+  Match *match = connection->match;
+  if (strncmp(buffer, "JOIN", 4) == 0) {
+    if (match != NULL) {
+      return true; // Already playing
+    }
+    match = find_open_match();
+    if (match == NULL) {
+      const char *msg = "Server full";
+      if (!send_queue_frame(&connection->out, client_socket, msg,
+                            strlen(msg) + 1) ||
+          connection->out.start == connection->out.end) {
+        return false;
+      }
+      connection->closing = true;
+      watch_writable(client_socket, true);
+      return true;
+    }
+    uint64_t nonce;
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    if (!random_u64(&nonce) ||
+        getpeername(client_socket, (struct sockaddr *)&peer, &peer_len) < 0) {
+      log_error("Cannot set up UDP for client %d: %s", client_socket,
+                strerror(errno));
+      return false;
+    }
+
+    pthread_mutex_lock(&match->mutex);
+    Client *clients = match->clients;
+    int num_clients = match->num_clients;
+    connection->match = match;
+    connection->slot = num_clients;
+    clients[num_clients].socket = client_socket;
+    clients[num_clients].acked_seq = 0;
+    clients[num_clients].udp_nonce = nonce;
+    clients[num_clients].udp_ready = false;
+    clients[num_clients].peer_addr = peer.sin_addr;
+    clients[num_clients].last_input_seq = 0;
+    clients[num_clients].applied_input_seq = 0;
+    send_queue_init(&clients[num_clients].out);
+    atomic_store_explicit(&clients[num_clients].input, 0,
+                          memory_order_relaxed);
+    sim_add_worm(&match->sim);
+    if (record_dir != NULL) {
+      match_log_join(&match->log);
+    }
 
-      // Check if bullet is out of bounds
-      if (worm->bullets[i].position.x < 0 ||
-          worm->bullets[i].position.x > SCREEN_WIDTH ||
-          worm->bullets[i].position.y < 0 ||
-          worm->bullets[i].position.y > SCREEN_HEIGHT) {
-        worm->bullets[i].active = false;
+    char update_msg[64];
+    snprintf(update_msg, sizeof(update_msg), "PLAYER_UPDATE %d Player%d",
+             num_clients, num_clients + 1);
+    char token_msg[64];
+    snprintf(token_msg, sizeof(token_msg), "UDP_TOKEN %d %llu", client_socket,
+             (unsigned long long)nonce);
+    char rate_msg[32];
+    snprintf(rate_msg, sizeof(rate_msg), "TICK_RATE %d", tick_rate);
+    char id_msg[32];
+    snprintf(id_msg, sizeof(id_msg), "PLAYER_ID %d", num_clients);
+    pthread_mutex_lock(&match->send_mutex);
+    for (int i = 0; i < num_clients; i++) {
+      send_control(&clients[i], update_msg);
+    }
+    send_control(&clients[num_clients], token_msg);
+    send_control(&clients[num_clients], rate_msg);
+    send_control(&clients[num_clients], id_msg);
+    match->membership_epoch++;
+    pthread_mutex_unlock(&match->send_mutex);
+
+    match->num_clients++;
+    log_info("New client joined match %d. Total clients: %d", match->id,
+             match->num_clients);
+    pthread_mutex_unlock(&match->mutex);
+  } else if (match == NULL) {
+    return true; // Everything else needs a match
+  } else if (strncmp(buffer, "START", 5) == 0) {
+    pthread_mutex_lock(&match->mutex);
+    if (!match->game_started) {
+      match->game_started = true;
+      log_info("Match %d started!", match->id);
+      const char *msg = "GAME_STARTED";
+      pthread_mutex_lock(&match->send_mutex);
+      for (int i = 0; i < match->num_clients; i++) {
+        send_control(&match->clients[i], msg);
       }
+      pthread_mutex_unlock(&match->send_mutex);
     }
+    pthread_mutex_unlock(&match->mutex);
+  } else if (strncmp(buffer, "ACK", 3) == 0) {
+    unsigned int seq;
+    if (sscanf(buffer, "ACK %u", &seq) == 1) {
+      pthread_mutex_lock(&match->mutex);
+      match->clients[connection->slot].acked_seq = seq;
+      pthread_mutex_unlock(&match->mutex);
+    }
+  } else if (strncmp(buffer, "INPUT", 5) == 0) {
+    // Slots only move in close_connection, on this same thread
+    // "INPUT <left> <right> <up> [<sequence>]", the flags each 0 or 1
+    static const uint8_t flags[] = {INPUT_LEFT, INPUT_RIGHT, INPUT_UP};
+    char *cursor = (char *)buffer + 5;
+    uint8_t bits = 0;
+    for (int i = 0; i < 3; i++) {
+      if (strtol(cursor, &cursor, 10) != 0) {
+        bits |= flags[i];
+      }
+    }
+    uint32_t seq = strtoul(cursor, &cursor, 10);
+    publish_input(&match->clients[connection->slot], bits, seq);
   }
+  return true;
 }
 
-bool checkBulletCollision(Point bullet_pos, Worm *target_worm) {
-  float dx = bullet_pos.x - target_worm->position.x;
-  float dy = bullet_pos.y - target_worm->position.y;
-  float distance = sqrt(dx * dx + dy * dy);
-  return distance < (WORM_RADIUS + BULLET_RADIUS);
-}
+// Handles one INPUT datagram. The connection id and nonce must match a
+// joined client; the sender's address then becomes that client's snapshot
+// destination, which later datagrams from the TCP peer's address can move
+// to follow NAT rebinding.
+void handle_udp(int sock) {
+  uint8_t buffer[256];
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  ssize_t n = recvfrom(sock, buffer, sizeof(buffer), 0,
+                       (struct sockaddr *)&addr, &addr_len);
+  if (n <= 0) {
+    return;
+  }
 
-void updateWorm(int clientIndex) {
-  Worm *worm = &clients[clientIndex].worm;
-  if (!worm->alive)
+  ByteReader reader = {buffer, n, 0, false};
+  if (get_u8(&reader) != UDP_INPUT) {
+    return;
+  }
+  uint32_t id = get_varint(&reader);
+  uint64_t nonce = get_u64(&reader);
+  uint32_t input_seq = get_varint(&reader);
+  uint8_t bits = get_u8(&reader);
+  uint32_t acked_seq = get_varint(&reader);
+  if (reader.error || id >= (uint32_t)connections_capacity ||
+      !connections[id].open || connections[id].match == NULL) {
     return;
+  }
+
+  Match *match = connections[id].match;
+  pthread_mutex_lock(&match->mutex);
+  Client *client = &match->clients[connections[id].slot];
+  if (client->udp_nonce == nonce && input_seq > client->last_input_seq) {
+    client->last_input_seq = input_seq;
+    client->acked_seq = acked_seq;
+    // The first datagram binds the snapshot destination; after that it only
+    // follows NAT rebinding from the TCP peer's address
+    if (!client->udp_ready ||
+        addr.sin_addr.s_addr == client->peer_addr.s_addr) {
+      client->udp_addr = addr;
+      client->udp_ready = true;
+    }
+    publish_input(client, bits, input_seq);
+  }
+  pthread_mutex_unlock(&match->mutex);
+}
+
+// The reactor multiplexes the listening socket, the discovery socket and
+// every client socket on the main thread: epoll on Linux, poll elsewhere.
+// Client sockets are also watched for writability while their send queue
+// holds something the reactor queued.
+#define REACTOR_READABLE 0x01
+#define REACTOR_WRITABLE 0x02
+
+typedef struct {
+  int fd;
+  int events; // REACTOR_* bits
+} ReactorEvent;
+
+#ifdef __linux__
+int reactor_fd = -1;
+
+void reactor_init() { reactor_fd = epoll_create1(0); }
+
+void reactor_add(int fd) {
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+  epoll_ctl(reactor_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+void reactor_remove(int fd) { epoll_ctl(reactor_fd, EPOLL_CTL_DEL, fd, NULL); }
 
-  pthread_mutex_lock(&worm->input_mutex);
-  InputState input = worm->input;
-  pthread_mutex_unlock(&worm->input_mutex);
+void reactor_set_writable(int fd, bool writable) {
+  struct epoll_event event = {
+      .events = EPOLLIN | (writable ? EPOLLOUT : 0), .data.fd = fd};
+  epoll_ctl(reactor_fd, EPOLL_CTL_MOD, fd, &event);
+}
 
-  if (input.left) {
-    worm->angle -= TURN_SPEED;
+// Blocks until some registered sockets are ready and stores up to max_ready
+// of them in ready. Returns how many were stored.
+int reactor_wait(ReactorEvent *ready, int max_ready) {
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(reactor_fd, events,
+                     max_ready < MAX_EVENTS ? max_ready : MAX_EVENTS, -1);
+  for (int i = 0; i < n; i++) {
+    ready[i].fd = events[i].data.fd;
+    ready[i].events =
+        (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ? REACTOR_READABLE
+                                                             : 0) |
+        (events[i].events & EPOLLOUT ? REACTOR_WRITABLE : 0);
   }
-  if (input.right) {
-    worm->angle += TURN_SPEED;
+  return n;
+}
+#else
+struct pollfd *poll_fds = NULL;
+int num_poll_fds = 0;
+int poll_fds_capacity = 0;
+
+void reactor_init() {}
+
+void reactor_add(int fd) {
+  if (num_poll_fds >= poll_fds_capacity) {
+    poll_fds_capacity = poll_fds_capacity ? poll_fds_capacity * 2 : 16;
+    poll_fds = realloc(poll_fds, poll_fds_capacity * sizeof(struct pollfd));
   }
+  poll_fds[num_poll_fds++] = (struct pollfd){fd, POLLIN, 0};
+}
 
-  float current_time = (float)clock() / CLOCKS_PER_SEC;
-  float current_speed = WORM_SPEED;
-  if (input.up) {
-    if (worm->speed_boost_time_left > 0) {
-      current_speed *= SPEED_BOOST_MULTIPLIER;
-      worm->speed_boost_time_left -= 1.0 / 60.0; // Assuming 60 FPS
-      if (worm->speed_boost_time_left <= 0) {
-        worm->speed_boost_time_left = 0;
-      }
-    } else if (worm->bullets_left > 0 &&
-               (current_time - worm->last_shot_time) >= BULLET_COOLDOWN) {
-      // Shoot a bullet
-      for (int i = 0; i < MAX_BULLETS; i++) {
-        if (!worm->bullets[i].active) {
-          worm->bullets[i].position = worm->position;
-          worm->bullets[i].angle = worm->angle;
-          worm->bullets[i].active = true;
-          worm->bullets_left--;
-          worm->last_shot_time = current_time;
-          printf("Bullet fired by worm %d. Bullets left: %d\n", clientIndex,
-                 worm->bullets_left);
-          break;
-        }
-      }
+void reactor_remove(int fd) {
+  for (int i = 0; i < num_poll_fds; i++) {
+    if (poll_fds[i].fd == fd) {
+      poll_fds[i] = poll_fds[--num_poll_fds];
+      return;
     }
-  } else {
-    worm->speed_boost_active = false;
-    worm->is_ghost = false;
   }
+}
+
+void reactor_set_writable(int fd, bool writable) {
+  for (int i = 0; i < num_poll_fds; i++) {
+    if (poll_fds[i].fd == fd) {
+      poll_fds[i].events = POLLIN | (writable ? POLLOUT : 0);
+      return;
+    }
+  }
+}
 
-  Point newPosition = {worm->position.x + cos(worm->angle) * current_speed,
-                       worm->position.y + sin(worm->angle) * current_speed};
+int reactor_wait(ReactorEvent *ready, int max_ready) {
+  if (poll(poll_fds, num_poll_fds, -1) < 0) {
+    return -1;
+  }
+  int n = 0;
+  for (int i = 0; i < num_poll_fds && n < max_ready; i++) {
+    int events =
+        (poll_fds[i].revents & (POLLIN | POLLHUP | POLLERR) ? REACTOR_READABLE
+                                                             : 0) |
+        (poll_fds[i].revents & POLLOUT ? REACTOR_WRITABLE : 0);
+    if (events != 0) {
+      ready[n++] = (ReactorEvent){poll_fds[i].fd, events};
+    }
+  }
+  return n;
+}
+#endif
+
+// Only the reactor thread calls this. The broadcasters never ask for
+// writability; they flush a client's queue ahead of each STATE instead.
+void watch_writable(int fd, bool writable) {
+  Connection *connection = &connections[fd];
+  if (connection->watching_writable != writable) {
+    connection->watching_writable = writable;
+    reactor_set_writable(fd, writable);
+  }
+}
 
-  newPosition.x = fmod(newPosition.x + SCREEN_WIDTH, SCREEN_WIDTH);
-  newPosition.y = fmod(newPosition.y + SCREEN_HEIGHT, SCREEN_HEIGHT);
+void open_connection(int client_socket) {
+  if (client_socket >= connections_capacity) {
+    int capacity = connections_capacity ? connections_capacity : 64;
+    while (capacity <= client_socket) {
+      capacity *= 2;
+    }
+    connections = realloc(connections, capacity * sizeof(Connection));
+    memset(connections + connections_capacity, 0,
+           (capacity - connections_capacity) * sizeof(Connection));
+    connections_capacity = capacity;
+  }
 
-  if (!worm->is_ghost && checkCollision(worm, newPosition)) {
-    worm->alive = false;
+  Connection *connection = &connections[client_socket];
+  if (!recv_buffer_init(&connection->buffer, CLIENT_RECV_BUFFER_SIZE)) {
+    close(client_socket);
+    return;
+  }
+  // Nothing the reactor does may wait on a peer
+  int flags = fcntl(client_socket, F_GETFL, 0);
+  if (flags < 0 || fcntl(client_socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+    log_error("fcntl: %s", strerror(errno));
+    recv_buffer_free(&connection->buffer);
+    close(client_socket);
+    return;
+  }
+  connection->open = true;
+  connection->match = NULL;
+  connection->slot = -1;
+  connection->watching_writable = false;
+  send_queue_init(&connection->out);
+  connection->closing = false;
+  reactor_add(client_socket);
+}
 
-    if (checkTailCollision(worm, newPosition)) {
-      printf("Worm %d collided with its own tail!\n", clientIndex);
-    } else {
-      printf("Worm %d collided and died!\n", clientIndex);
+void close_connection(int client_socket) {
+  Connection *connection = &connections[client_socket];
+  reactor_remove(client_socket);
+  recv_buffer_free(&connection->buffer);
+  send_queue_free(&connection->out);
+  connection->open = false;
+
+  Match *match = connection->match;
+  if (match != NULL) {
+    pthread_mutex_lock(&match->mutex);
+    Client *clients = match->clients;
+    int i = connection->slot;
+    sim_remove_worm(&match->sim, i);
+    if (record_dir != NULL) {
+      match_log_leave(&match->log, i);
+    }
+    // The broadcasters find send queues by slot, so slots move under
+    // send_mutex along with the epoch
+    pthread_mutex_lock(&match->send_mutex);
+    send_queue_free(&clients[i].out);
+    for (int j = i; j < match->num_clients - 1; j++) {
+      clients[j] = clients[j + 1];
+      connections[clients[j].socket].slot = j;
     }
-    worm->path_length = 0;
-    cleanupWorm(worm);
+    match->num_clients--;
+    match->membership_epoch++;
+    // Everyone after the leaver now plays the next worm down
+    for (int j = i; j < match->num_clients; j++) {
+      char id_msg[32];
+      snprintf(id_msg, sizeof(id_msg), "PLAYER_ID %d", j);
+      send_control(&clients[j], id_msg);
+    }
+    pthread_mutex_unlock(&match->send_mutex);
+    log_info("Client left match %d. Total clients: %d", match->id,
+             match->num_clients);
+    MatchLog finished = {0};
+    if (match->num_clients == 0) {
+      reset_match(match, &finished);
+    }
+    pthread_mutex_unlock(&match->mutex);
+    save_match_log(&finished, match->id);
+  }
+  close(client_socket);
+}
+
+// Sends what the socket's send queue holds now that it takes more, and stops
+// watching it once the queue is empty
+void handle_writable(int client_socket) {
+  Connection *connection = &connections[client_socket];
+  Match *match = connection->match;
+  ssize_t queued;
+  if (match != NULL) {
+    pthread_mutex_lock(&match->send_mutex);
+    queued = send_queue_flush(&match->clients[connection->slot].out,
+                              client_socket);
+    pthread_mutex_unlock(&match->send_mutex);
   } else {
-    worm->position = newPosition;
-    addPointToPath(worm, newPosition);
-
-    for (int i = 0; i < active_powerups; i++) {
-      if (powerups[i].active) {
-        float dx = worm->position.x - powerups[i].position.x;
-        float dy = worm->position.y - powerups[i].position.y;
-        float distance = sqrt(dx * dx + dy * dy);
-        if (distance < POWERUP_RADIUS + WORM_RADIUS) {
-          if (powerups[i].type == POWERUP_BULLETS) {
-            worm->bullets_left = 3;
-            worm->speed_boost_time_left = 0;
-            worm->speed_boost_active = false;
-            worm->is_ghost = false;
-          } else if (powerups[i].type == POWERUP_SPEED) {
-            worm->speed_boost_time_left = SPEED_BOOST_DURATION;
-            worm->bullets_left = 0;
-            worm->is_ghost = false;
-          } else if (powerups[i].type == POWERUP_GHOST) {
-            worm->is_ghost = true;
-            worm->speed_boost_time_left = 0;
-            worm->bullets_left = 0;
-          }
-          powerups[i].active = false;
-          // Move last active powerup to this slot and decrease count
-          powerups[i] = powerups[--active_powerups];
-          printf("Worm %d collected a powerup! Type: %d\n", clientIndex,
-                 powerups[i].type);
-        }
-      }
+    queued = send_queue_flush(&connection->out, client_socket);
+  }
+  // A failed socket is closed when its error is read
+  if (queued <= 0) {
+    watch_writable(client_socket, false);
+    if (connection->closing) {
+      close_connection(client_socket);
     }
   }
+}
 
-  updateBullets(worm);
+// Reads what one client socket has and handles every complete message in it
+void handle_client(int client_socket) {
+  Connection *connection = &connections[client_socket];
+  ssize_t n = recv_buffer_fill(&connection->buffer, client_socket);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if (n <= 0) {
+    close_connection(client_socket);
+    return;
+  }
 
-  for (int i = 0; i < MAX_BULLETS; i++) {
-    if (worm->bullets[i].active) {
-      for (int j = 0; j < num_clients; j++) {
-        if (j != clientIndex && clients[j].worm.alive) {
-          if (checkBulletCollision(worm->bullets[i].position,
-                                   &clients[j].worm)) {
-            clients[j].worm.alive = false;
-            worm->bullets[i].active = false;
-            printf("Worm %d shot and killed worm %d!\n", clientIndex, j);
-          }
-        }
-      }
+  const uint8_t *frame;
+  size_t length;
+  while ((frame = recv_buffer_next_frame(&connection->buffer, &length)) !=
+         NULL) {
+    // Client messages are all NUL-terminated text
+    if (connection->closing || length == 0 || frame[length - 1] != '\0') {
+      continue;
+    }
+    if (!handle_message(client_socket, (const char *)frame)) {
+      close_connection(client_socket);
+      return;
     }
   }
 }
 
-void handle_client(int client_socket) {
-  char buffer[8192];
-  int n;
-
-  while ((n = recv(client_socket, buffer, sizeof(buffer), 0)) > 0) {
-    buffer[n] = '\0';
-    if (strncmp(buffer, "JOIN", 4) == 0) {
-      pthread_mutex_lock(&clients_mutex);
-      if (num_clients < MAX_CLIENTS) {
-        clients[num_clients].socket = client_socket;
-
-        float angle = (2 * PI * num_clients) / MAX_CLIENTS;
-        float startX = SCREEN_WIDTH / 2.0 + SPAWN_CIRCLE_RADIUS * cos(angle);
-        float startY = SCREEN_HEIGHT / 2.0 + SPAWN_CIRCLE_RADIUS * sin(angle);
-        float spawnAngle = angle;
-        spawnAngle += ((rand() % 200) / 100.0) - 1.0;
-
-        initWorm(&clients[num_clients].worm, startX, startY, spawnAngle);
-
-        char update_msg[64];
-        snprintf(update_msg, sizeof(update_msg), "PLAYER_UPDATE %d Player%d",
-                 num_clients, num_clients + 1);
-        for (int i = 0; i < num_clients; i++) {
-          send(clients[i].socket, update_msg, strlen(update_msg), 0);
-        }
+// Index of the first path point the client still needs for worm. Everything
+// before the last point it acknowledged is immutable; that last point is
+// resent because addPointToPath may have moved it. Returns 0 (full resync)
+// when the acknowledged snapshot is unknown or had another worm in this slot.
+int path_delta_start(Match *match, Client *client, int slot) {
+  Worm *worm = &match->sim.worms[slot];
+  unsigned int acked = client->acked_seq;
+  if (acked == 0 || match->snapshot_seq - acked >= SNAPSHOT_HISTORY) {
+    return 0;
+  }
 
-        num_clients++;
-        printf("New client joined. Total clients: %d\n", num_clients);
-      } else {
-        const char *msg = "Server full";
-        send(client_socket, msg, strlen(msg), 0);
-        close(client_socket);
-        pthread_mutex_unlock(&clients_mutex);
-        return;
-      }
-      pthread_mutex_unlock(&clients_mutex);
-    } else if (strncmp(buffer, "START", 5) == 0) {
-      if (!game_started && num_clients > 0) {
-        game_started = true;
-        printf("Game started!\n");
-        const char *msg = "GAME_STARTED";
-        for (int i = 0; i < num_clients; i++) {
-          send(clients[i].socket, msg, strlen(msg), 0);
-        }
-      }
-    } else if (strncmp(buffer, "INPUT", 5) == 0) {
-      for (int i = 0; i < num_clients; i++) {
-        if (clients[i].socket == client_socket) {
-          pthread_mutex_lock(&clients[i].worm.input_mutex);
-          sscanf(buffer, "INPUT %d %d %d", &clients[i].worm.input.left,
-                 &clients[i].worm.input.right, &clients[i].worm.input.up);
-          pthread_mutex_unlock(&clients[i].worm.input_mutex);
-          break;
-        }
-      }
+  SnapshotRecord *record = &match->snapshot_history[acked % SNAPSHOT_HISTORY];
+  if (record->seq != acked) {
+    return 0;
+  }
+
+  if (slot >= record->num_worms || record->worm_ids[slot] != worm->id) {
+    return 0;
+  }
+  int start = record->path_lengths[slot] - 1;
+  return (start > 0 && start <= worm->path_length) ? start : 0;
+}
+
+int build_state_message(const WorldState *world, char *state, size_t size,
+                        const int *path_starts) {
+  return text_protocol ? build_text_state(world, state, size, path_starts)
+                       : build_binary_state(world, state, size, path_starts);
+}
+
+// Copies what this tick's STATE messages need out of the match. Called with
+// the match mutex held; the cost is the path tail the laggiest recipient
+// still lacks, normally a point or two per worm.
+Snapshot *capture_snapshot(Match *match) {
+  Snapshot *snapshot = calloc(1, sizeof(Snapshot));
+  if (snapshot == NULL) {
+    return NULL;
+  }
+  snapshot->epoch = match->membership_epoch;
+  WorldState *world = &snapshot->world;
+  world->seq = match->snapshot_seq;
+  world->num_worms = match->num_clients;
+  world->num_powerups = match->sim.active_powerups;
+  memcpy(world->powerups, match->sim.powerups, sizeof(world->powerups));
+
+  int total_points = 0;
+  for (int r = 0; r < match->num_clients; r++) {
+    Client *client = &match->clients[r];
+    Recipient *recipient = &snapshot->recipients[r];
+    recipient->socket = client->socket;
+    recipient->udp_ready = client->udp_ready;
+    recipient->udp_addr = client->udp_addr;
+    for (int i = 0; i < match->num_clients; i++) {
+      recipient->path_starts[i] = path_delta_start(match, client, i);
     }
   }
 
-  pthread_mutex_lock(&clients_mutex);
-  for (int i = 0; i < num_clients; i++) {
-    if (clients[i].socket == client_socket) {
-      cleanupWorm(&clients[i].worm);
-      for (int j = i; j < num_clients - 1; j++) {
-        clients[j] = clients[j + 1];
+  for (int i = 0; i < match->num_clients; i++) {
+    Worm *worm = &match->sim.worms[i];
+    WormSnapshot *copy = &world->worms[i];
+    copy->position = worm->position;
+    copy->angle = worm->angle;
+    copy->alive = worm->alive;
+    copy->bullets_left = worm->bullets_left;
+    memcpy(copy->bullets, worm->bullets, sizeof(copy->bullets));
+    copy->speed_boost_time_left = worm->speed_boost_time_left;
+    copy->speed_boost_active = worm->speed_boost_active;
+    copy->is_ghost = worm->is_ghost;
+    copy->input_seq = match->clients[i].applied_input_seq;
+    copy->path_length = worm->path_length;
+    copy->path_base = worm->path_length;
+    for (int r = 0; r < match->num_clients; r++) {
+      if (snapshot->recipients[r].path_starts[i] < copy->path_base) {
+        copy->path_base = snapshot->recipients[r].path_starts[i];
       }
-      num_clients--;
-      break;
     }
+    total_points += copy->path_length - copy->path_base;
   }
-  pthread_mutex_unlock(&clients_mutex);
-  close(client_socket);
-  printf("Client disconnected. Total clients: %d\n", num_clients);
+
+  snapshot->points = malloc((total_points > 0 ? total_points : 1) *
+                            sizeof(Point));
+  if (snapshot->points == NULL) {
+    free(snapshot);
+    return NULL;
+  }
+  Point *next = snapshot->points;
+  for (int i = 0; i < match->num_clients; i++) {
+    WormSnapshot *copy = &world->worms[i];
+    int count = copy->path_length - copy->path_base;
+    copy->points = next;
+    sim_copy_path(&match->sim.worms[i], copy->path_base, copy->path_length,
+                  next);
+    next += count;
+  }
+  return snapshot;
 }
 
-void game_loop() {
-  while (1) {
-    if (game_started && num_clients > 0) {
-      pthread_mutex_lock(&clients_mutex);
-
-      // Spawn powerups
-      time_t current_time = time(NULL);
-      if (current_time - last_powerup_spawn >= POWERUP_SPAWN_INTERVAL) {
-        spawnPowerup();
-        last_powerup_spawn = current_time;
+// Simulates one tick and publishes its snapshot. The match mutex covers the
+// simulation and the capture only; encoding and sending happen in
+// broadcast_snapshot. A snapshot still pending from the previous tick is
+// superseded, which clients handle like a lost datagram.
+void game_tick(Match *match, Histogram *metrics) {
+  int64_t start = monotonic_ns();
+  pthread_mutex_lock(&match->mutex);
+  if (!match->game_started || match->num_clients == 0) {
+    pthread_mutex_unlock(&match->mutex);
+    return;
+  }
+  int64_t locked = monotonic_ns();
+  uint8_t inputs[MAX_CLIENTS];
+  for (int i = 0; i < match->num_clients; i++) {
+    uint32_t input = atomic_load_explicit(&match->clients[i].input,
+                                          memory_order_acquire);
+    inputs[i] = input & INPUT_BITS_MASK;
+    match->clients[i].applied_input_seq = input >> INPUT_SEQ_SHIFT;
+  }
+  sim_advance(&match->sim);
+  int64_t advanced = monotonic_ns();
+  sim_update_worms(&match->sim, inputs);
+  int64_t updated = monotonic_ns();
+  if (record_dir != NULL) {
+    match_log_tick(&match->log, inputs, match->num_clients);
+    if (match->sim.current_tick % LOG_CHECK_INTERVAL == 0) {
+      match_log_check(&match->log, sim_hash(&match->sim));
+    }
+  }
+
+  match->snapshot_seq++;
+  Snapshot *snapshot = capture_snapshot(match);
+
+  SnapshotRecord *record =
+      &match->snapshot_history[match->snapshot_seq % SNAPSHOT_HISTORY];
+  record->seq = match->snapshot_seq;
+  record->num_worms = match->num_clients;
+  for (int i = 0; i < match->num_clients; i++) {
+    record->worm_ids[i] = match->sim.worms[i].id;
+    record->path_lengths[i] = match->sim.worms[i].path_length;
+  }
+
+  pthread_mutex_unlock(&match->mutex);
+  int64_t captured = monotonic_ns();
+  histogram_record(&metrics[METRIC_LOCK], captured, locked - start);
+  histogram_record(&metrics[METRIC_POWERUPS], captured, advanced - locked);
+  histogram_record(&metrics[METRIC_WORMS], captured, updated - advanced);
+  histogram_record(&metrics[METRIC_CAPTURE], captured, captured - updated);
+
+  if (snapshot != NULL) {
+    Snapshot *superseded = atomic_exchange(&match->pending, snapshot);
+    if (superseded != NULL) {
+      snapshot_free(superseded);
+    }
+  }
+}
+
+// Encodes a snapshot once per distinct set of path baselines among its
+// recipients (normally one, as every client acknowledges each tick) and
+// sends the same bytes to each recipient sharing it. encoded[] holds
+// MAX_CLIENTS buffers of STATE_BUFFER_SIZE. A recipient whose send queue
+// cannot take the frame misses it, as if it were a lost datagram.
+void broadcast_snapshot(Match *match, const Snapshot *snapshot,
+                        char **encoded, Worker *worker) {
+  Histogram *metrics = worker->metrics;
+  int source[MAX_CLIENTS];
+  int lengths[MAX_CLIENTS];
+  uint64_t bytes_encoded = 0, bytes_sent = 0;
+  int64_t start = monotonic_ns();
+  for (int r = 0; r < snapshot->world.num_worms; r++) {
+    const int *starts = snapshot->recipients[r].path_starts;
+    source[r] = r;
+    for (int q = 0; q < r; q++) {
+      if (memcmp(starts, snapshot->recipients[q].path_starts,
+                 sizeof(snapshot->recipients[q].path_starts)) == 0) {
+        source[r] = source[q];
+        break;
       }
+    }
+    if (source[r] == r) {
+      lengths[r] = build_state_message(&snapshot->world, encoded[r],
+                                       STATE_BUFFER_SIZE, starts);
+      bytes_encoded += lengths[r];
+    }
+  }
 
-      for (int i = 0; i < num_clients; i++) {
-        updateWorm(i);
+  int64_t encoded_at = monotonic_ns();
+  pthread_mutex_lock(&match->send_mutex);
+  if (match->membership_epoch == snapshot->epoch) {
+    for (int r = 0; r < snapshot->world.num_worms; r++) {
+      const Recipient *recipient = &snapshot->recipients[r];
+      const char *state = encoded[source[r]];
+      int length = lengths[source[r]];
+      // A lost datagram costs nothing: the next one is built against
+      // whatever the client acknowledged. Resyncs too big for a datagram
+      // use TCP.
+      if (recipient->udp_ready && length <= UDP_MAX_PAYLOAD) {
+        sendto(udp_socket, state, length, MSG_DONTWAIT,
+               (const struct sockaddr *)&recipient->udp_addr,
+               sizeof(recipient->udp_addr));
+      } else {
+        // Text frames include the terminator, as the client tells text
+        // messages apart by it (protocol.h). The epoch check means client r
+        // is still this recipient.
+        Client *client = &match->clients[r];
+        if (!send_queue_frame(&client->out, recipient->socket, state,
+                              text_protocol ? length + 1 : length)) {
+          STAT_ADD(worker->dropped_frames, 1);
+          continue;
+        }
       }
+      bytes_sent += length;
+    }
+  }
+  pthread_mutex_unlock(&match->send_mutex);
+  int64_t sent_at = monotonic_ns();
+  histogram_record(&metrics[METRIC_ENCODE], sent_at, encoded_at - start);
+  histogram_record(&metrics[METRIC_SEND], sent_at, sent_at - encoded_at);
+  histogram_record(&metrics[METRIC_BYTES_ENCODED], sent_at, bytes_encoded);
+  histogram_record(&metrics[METRIC_BYTES_SENT], sent_at, bytes_sent);
+}
+
+void *broadcast_loop(void *arg) {
+  Worker *worker = arg;
+  char *encoded[MAX_CLIENTS];
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    encoded[i] = malloc(STATE_BUFFER_SIZE);
+  }
+  unsigned long seen = 0;
 
-      char state[16384 * 16];
-      int offset = 0;
-      offset += snprintf(state + offset, sizeof(state) - offset, "STATE %d ",
-                         num_clients);
-
-      // Add powerup information
-      offset += snprintf(state + offset, sizeof(state) - offset, "%d ",
-                         active_powerups);
-      for (int i = 0; i < active_powerups; i++) {
-        offset += snprintf(state + offset, sizeof(state) - offset,
-                           "%.2f %.2f %d ", powerups[i].position.x,
-                           powerups[i].position.y, powerups[i].type);
+  while (1) {
+    pthread_mutex_lock(&worker->wake_mutex);
+    while (worker->generation == seen) {
+      pthread_cond_wait(&worker->wake, &worker->wake_mutex);
+    }
+    seen = worker->generation;
+    pthread_mutex_unlock(&worker->wake_mutex);
+
+    for (int m = worker->index; m < MAX_MATCHES; m += num_workers) {
+      Snapshot *snapshot = atomic_exchange(&matches[m].pending, NULL);
+      if (snapshot != NULL) {
+        broadcast_snapshot(&matches[m], snapshot, encoded, worker);
+        snapshot_free(snapshot);
       }
+    }
+  }
+  return NULL;
+}
 
-      for (int i = 0; i < num_clients; i++) {
-        Worm *worm = &clients[i].worm;
-        // In the main game loop, update how you send the state
-        offset +=
-            snprintf(state + offset, sizeof(state) - offset,
-                     "%d %.2f %.2f %.2f %d %d %.2f %d %d %d ",
-                     worm->path_length, worm->position.x, worm->position.y,
-                     worm->angle, worm->alive ? 1 : 0, worm->bullets_left,
-                     worm->speed_boost_time_left,
-                     worm->speed_boost_active ? 1 : 0, worm->is_ghost ? 1 : 0,
-                     worm->path_length); // Send the full path length
-
-        // Add bullet information
-        for (int j = 0; j < MAX_BULLETS; j++) {
-          if (worm->bullets[j].active) {
-            offset +=
-                snprintf(state + offset, sizeof(state) - offset,
-                         "%.2f %.2f %.2f ", worm->bullets[j].position.x,
-                         worm->bullets[j].position.y, worm->bullets[j].angle);
-          } else {
-            offset +=
-                snprintf(state + offset, sizeof(state) - offset, "0 0 0 ");
-          }
-        }
+void sleep_until(int64_t deadline_ns) {
+#ifdef __APPLE__
+  // No clock_nanosleep on macOS; a relative sleep to the deadline is close
+  int64_t remaining = deadline_ns - monotonic_ns();
+  if (remaining > 0) {
+    struct timespec duration = {remaining / 1000000000, remaining % 1000000000};
+    nanosleep(&duration, NULL);
+  }
+#else
+  struct timespec deadline = {deadline_ns / 1000000000,
+                              deadline_ns % 1000000000};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+         EINTR) {
+  }
+#endif
+}
 
-        // Add all path points
-        for (int j = 0; j < worm->path_length; j++) {
-          offset += snprintf(state + offset, sizeof(state) - offset,
-                             "%.2f %.2f ", worm->path[j].x, worm->path[j].y);
-        }
+// Each worker ticks every num_workers-th match on a fixed grid of absolute
+// deadlines, so the tick rate does not depend on how long each tick takes.
+// A tick that ends late is counted as an overrun and the next one starts
+// immediately to catch up; more than MAX_CATCHUP_TICKS behind, the missed
+// ticks are dropped instead.
+void *worker_loop(void *arg) {
+  Worker *worker = arg;
+  TickStats *stats = &worker->stats;
+  const int64_t tick_ns = 1000000000 / tick_rate;
+  int64_t deadline = monotonic_ns();
+  unsigned long reported_overruns = 0;
 
-        if (offset >= (int)sizeof(state) - 1) {
-          fprintf(stderr, "State message truncated\n");
-          break;
-        }
+  while (1) {
+    sleep_until(deadline);
+    int64_t start = monotonic_ns();
+    for (int m = worker->index; m < MAX_MATCHES; m += num_workers) {
+      game_tick(&matches[m], worker->metrics);
+    }
+    pthread_mutex_lock(&worker->wake_mutex);
+    worker->generation++;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->wake_mutex);
+    unsigned long ticks = STAT_ADD(stats->ticks, 1) + 1;
+    deadline += tick_ns;
+
+    int64_t now = monotonic_ns();
+    histogram_record(&worker->metrics[METRIC_ROUND], now, now - start);
+    int64_t lateness = now - deadline;
+    if (lateness > 0) {
+      STAT_ADD(stats->overruns, 1);
+      if (lateness > STAT_LOAD(stats->max_lateness_ns)) {
+        STAT_STORE(stats->max_lateness_ns, lateness);
       }
-      for (int i = 0; i < num_clients; i++) {
-        send(clients[i].socket, state, strlen(state), 0);
+      if (lateness > MAX_CATCHUP_TICKS * tick_ns) {
+        STAT_ADD(stats->dropped, lateness / tick_ns);
+        deadline += (lateness / tick_ns) * tick_ns;
       }
+    }
 
-      pthread_mutex_unlock(&clients_mutex);
+    unsigned long overruns = STAT_LOAD(stats->overruns);
+    if (ticks % (TICK_REPORT_INTERVAL * tick_rate) == 0 &&
+        overruns != reported_overruns) {
+      log_warn("Worker %d tick overruns: %lu (%lu new), dropped: %lu, "
+               "worst: %.2f ms",
+               worker->index, overruns, overruns - reported_overruns,
+               STAT_LOAD(stats->dropped),
+               STAT_LOAD(stats->max_lateness_ns) / 1e6);
+      reported_overruns = overruns;
     }
-    usleep(16667); // ~60 FPS
   }
+  return NULL;
 }
 
+// Only async-signal-safe calls here: the reactor does the actual shutdown
+// when it reads the byte.
 void handle_shutdown(int sig) {
-  printf("Shutting down server...\n");
+  (void)sig;
+  int saved_errno = errno;
+  ssize_t written = write(shutdown_pipe[1], "", 1);
+  (void)written;
+  errno = saved_errno;
+}
+
+void shutdown_server() {
+  log_info("Shutting down server...");
+  for (int i = 0; i < num_workers; i++) {
+    log_info("Worker %d ticks: %lu, overruns: %lu, dropped: %lu", i,
+             STAT_LOAD(workers[i].stats.ticks),
+             STAT_LOAD(workers[i].stats.overruns),
+             STAT_LOAD(workers[i].stats.dropped));
+  }
+  if (stats_socket_path[0] != '\0') {
+    unlink(stats_socket_path);
+  }
   cleanup_game();
   exit(0);
 }
 
-void *handle_discovery(void *arg) {
-  int discovery_socket = socket(AF_INET, SOCK_DGRAM, 0);
-  if (discovery_socket < 0) {
-    perror("Discovery socket creation failed");
-    return NULL;
+int open_udp_socket(int port) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    log_error("UDP socket creation failed: %s", strerror(errno));
+    return -1;
   }
 
-  struct sockaddr_in discovery_addr;
-  memset(&discovery_addr, 0, sizeof(discovery_addr));
-  discovery_addr.sin_family = AF_INET;
-  discovery_addr.sin_addr.s_addr = INADDR_ANY;
-  discovery_addr.sin_port = htons(DISCOVERY_PORT);
+  struct sockaddr_in udp_addr;
+  memset(&udp_addr, 0, sizeof(udp_addr));
+  udp_addr.sin_family = AF_INET;
+  udp_addr.sin_addr.s_addr = INADDR_ANY;
+  udp_addr.sin_port = htons(port);
 
-  if (bind(discovery_socket, (struct sockaddr *)&discovery_addr,
-           sizeof(discovery_addr)) < 0) {
-    perror("Bind failed");
-    close(discovery_socket);
-    return NULL;
+  if (bind(sock, (struct sockaddr *)&udp_addr, sizeof(udp_addr)) < 0) {
+    log_error("Bind failed: %s", strerror(errno));
+    close(sock);
+    return -1;
   }
+  return sock;
+}
 
+void handle_discovery(int discovery_socket) {
   char buffer[256];
   struct sockaddr_in client_addr;
   socklen_t addr_len = sizeof(client_addr);
 
-  while (1) {
-    int received = recvfrom(discovery_socket, buffer, sizeof(buffer) - 1, 0,
-                            (struct sockaddr *)&client_addr, &addr_len);
-    if (received < 0) {
-      perror("Receive failed");
-      continue;
+  int received = recvfrom(discovery_socket, buffer, sizeof(buffer) - 1, 0,
+                          (struct sockaddr *)&client_addr, &addr_len);
+  if (received < 0) {
+    log_error("Receive failed: %s", strerror(errno));
+    return;
+  }
+
+  buffer[received] = '\0';
+  if (strcmp(buffer, "DISCOVER_BATTLE_NOODLES_SERVER") == 0) {
+    char response[256];
+    snprintf(response, sizeof(response), "BATTLE_NOODLES_SERVER %s %d",
+             SERVER_NAME, GAME_PORT);
+    sendto(discovery_socket, response, strlen(response), 0,
+           (struct sockaddr *)&client_addr, addr_len);
+  }
+}
+
+// Listens on a Unix domain socket for stats scrapers, such as
+// `nc -U /tmp/battle_noodles_server.sock`. Returns -1 on failure.
+int open_stats_socket(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    log_error("Stats socket path too long: %s", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
+    log_error("Stats socket creation failed: %s", strerror(errno));
+    return -1;
+  }
+  unlink(path); // Left behind by a server that did not shut down cleanly
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sock, 8) < 0) {
+    log_error("Stats socket bind failed: %s", strerror(errno));
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// One JSON object: what the matches hold right now, the tick counters since
+// startup, and the percentiles of every metric over all workers in the last
+// HISTOGRAM_WINDOWS seconds. Returns the length written.
+int build_stats(char *buffer, size_t size) {
+  int64_t now = monotonic_ns();
+  int active_matches = 0, clients = 0;
+  long path_points = 0;
+  for (int m = 0; m < MAX_MATCHES; m++) {
+    Match *match = &matches[m];
+    pthread_mutex_lock(&match->mutex);
+    clients += match->num_clients;
+    if (match->game_started && match->num_clients > 0) {
+      active_matches++;
+    }
+    for (int i = 0; i < match->sim.num_worms; i++) {
+      path_points += match->sim.worms[i].path_length;
     }
+    pthread_mutex_unlock(&match->mutex);
+  }
 
-    buffer[received] = '\0';
-    if (strcmp(buffer, "DISCOVER_BATTLE_NOODLES_SERVER") == 0) {
-      char response[256];
-      snprintf(response, sizeof(response), "BATTLE_NOODLES_SERVER %s %d",
-               SERVER_NAME, GAME_PORT);
-      sendto(discovery_socket, response, strlen(response), 0,
-             (struct sockaddr *)&client_addr, addr_len);
+  unsigned long ticks = 0, overruns = 0, dropped = 0, dropped_frames = 0;
+  int64_t max_lateness_ns = 0;
+  for (int i = 0; i < num_workers; i++) {
+    TickStats *stats = &workers[i].stats;
+    ticks += STAT_LOAD(stats->ticks);
+    overruns += STAT_LOAD(stats->overruns);
+    dropped += STAT_LOAD(stats->dropped);
+    dropped_frames += STAT_LOAD(workers[i].dropped_frames);
+    int64_t lateness = STAT_LOAD(stats->max_lateness_ns);
+    if (lateness > max_lateness_ns) {
+      max_lateness_ns = lateness;
     }
   }
 
-  close(discovery_socket);
-  return NULL;
+  int offset = snprintf(
+      buffer, size,
+      "{\n  \"uptime_s\": %.1f, \"tick_rate\": %d, \"workers\": %d,\n"
+      "  \"matches_active\": %d, \"clients\": %d, \"path_points\": %ld,\n"
+      "  \"ticks\": %lu, \"overruns\": %lu, \"dropped\": %lu, "
+      "\"dropped_frames\": %lu, \"max_lateness_ms\": %.3f,\n"
+      "  \"window_s\": %d,\n  \"metrics\": {",
+      (now - start_ns) / 1e9, tick_rate, num_workers, active_matches, clients,
+      path_points, ticks, overruns, dropped, dropped_frames,
+      max_lateness_ns / 1e6, HISTOGRAM_WINDOWS);
+
+  HistogramTotals totals;
+  for (int metric = 0; metric < NUM_METRICS && offset < (int)size; metric++) {
+    memset(&totals, 0, sizeof(totals));
+    for (int i = 0; i < num_workers; i++) {
+      histogram_collect(&workers[i].metrics[metric], now, &totals);
+    }
+    offset += snprintf(
+        buffer + offset, size - offset,
+        "%s\n    \"%s\": {\"count\": %llu, \"p50\": %llu, "
+        "\"p90\": %llu, \"p99\": %llu, \"max\": %llu}",
+        metric ? "," : "", metric_names[metric],
+        (unsigned long long)totals.count,
+        (unsigned long long)histogram_quantile(&totals, 0.5),
+        (unsigned long long)histogram_quantile(&totals, 0.9),
+        (unsigned long long)histogram_quantile(&totals, 0.99),
+        (unsigned long long)totals.max);
+  }
+  if (offset < (int)size) {
+    offset += snprintf(buffer + offset, size - offset, "\n  }\n}\n");
+  }
+  return offset < (int)size ? offset : (int)size - 1;
+}
+
+// Answers one scraper with a stats dump and hangs up. The dump fits in a
+// socket buffer; a scraper that has not drained the last one gets it cut
+// short rather than stalling the reactor.
+void handle_stats(int stats_socket) {
+  int sock = accept(stats_socket, NULL, NULL);
+  if (sock < 0) {
+    log_error("Stats accept failed: %s", strerror(errno));
+    return;
+  }
+  char buffer[STATS_BUFFER_SIZE];
+  int length = build_stats(buffer, sizeof(buffer));
+  for (int sent = 0; sent < length;) {
+    ssize_t n = send(sock, buffer + sent, length - sent, MSG_DONTWAIT);
+    if (n <= 0) {
+      break;
+    }
+    sent += n;
+  }
+  close(sock);
 }
 
-int main() {
-  srand(time(NULL));
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--text-protocol") == 0) {
+      text_protocol = true;
+    } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      num_workers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--tick-rate") == 0 && i + 1 < argc) {
+      tick_rate = atoi(argv[++i]);
+      if (tick_rate <= 0) {
+        log_error("Invalid tick rate");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--stats-socket") == 0 && i + 1 < argc) {
+      stats_socket_path = argv[++i];
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record_dir = argv[++i];
+    } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+      log_level_name = argv[++i];
+    }
+  }
+  int level = log_level_from_name(log_level_name);
+  if (level < 0) {
+    log_error("Invalid log level: %s", log_level_name);
+    exit(EXIT_FAILURE);
+  }
+  log_init(level);
+  start_ns = monotonic_ns();
+
   int server_fd, new_socket;
   struct sockaddr_in address;
   int opt = 1;
   int addrlen = sizeof(address);
 
   // Handle ctrl+c
+  if (pipe(shutdown_pipe) < 0 ||
+      fcntl(shutdown_pipe[1], F_SETFL, O_NONBLOCK) < 0) {
+    log_error("pipe: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
   signal(SIGINT, handle_shutdown);
+  // A client vanishing mid-send must not kill the server
+  signal(SIGPIPE, SIG_IGN);
 
   if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-    perror("socket failed");
+    log_error("socket failed: %s", strerror(errno));
     exit(EXIT_FAILURE);
   }
 
   if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-    perror("setsockopt");
+    log_error("setsockopt: %s", strerror(errno));
     exit(EXIT_FAILURE);
   }
 
@@ -566,35 +1271,95 @@ int main() {
   address.sin_port = htons(8080);
 
   if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-    perror("bind failed");
+    log_error("bind failed: %s", strerror(errno));
     exit(EXIT_FAILURE);
   }
 
-  if (listen(server_fd, 3) < 0) {
-    perror("listen");
+  if (listen(server_fd, SOMAXCONN) < 0) {
+    log_error("listen: %s", strerror(errno));
     exit(EXIT_FAILURE);
   }
 
-  pthread_t discovery_thread;
-  pthread_create(&discovery_thread, NULL, handle_discovery, NULL);
+  reactor_init();
+  reactor_add(server_fd);
+  reactor_add(shutdown_pipe[0]);
+  int discovery_socket = open_udp_socket(DISCOVERY_PORT);
+  if (discovery_socket >= 0) {
+    reactor_add(discovery_socket);
+  }
+  udp_socket = open_udp_socket(GAME_PORT);
+  if (udp_socket >= 0) {
+    reactor_add(udp_socket);
+  }
+  int stats_socket = -1;
+  if (stats_socket_path[0] != '\0') {
+    stats_socket = open_stats_socket(stats_socket_path);
+  }
+  if (stats_socket >= 0) {
+    reactor_add(stats_socket);
+    log_info("Stats on %s", stats_socket_path);
+  }
 
-  printf("Server listening on port 8080\n");
+  log_info("Server listening on port 8080");
+
+  for (int m = 0; m < MAX_MATCHES; m++) {
+    matches[m].id = m;
+    pthread_mutex_init(&matches[m].mutex, NULL);
+    pthread_mutex_init(&matches[m].send_mutex, NULL);
+    sim_init(&matches[m].sim, 1, tick_rate);
+    atomic_init(&matches[m].pending, NULL);
+    MatchLog unused;
+    reset_match(&matches[m], &unused);
+    match_log_free(&unused);
+  }
 
-  pthread_t game_thread;
-  pthread_create(&game_thread, NULL, (void *(*)(void *))game_loop, NULL);
+  if (num_workers <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = cpus > 0 ? cpus : 1;
+  }
+  workers = calloc(num_workers, sizeof(Worker));
+  for (int i = 0; i < num_workers; i++) {
+    workers[i].index = i;
+    workers[i].metrics = calloc(NUM_METRICS, sizeof(Histogram));
+    for (int metric = 0; metric < NUM_METRICS; metric++) {
+      histogram_init(&workers[i].metrics[metric]);
+    }
+    pthread_mutex_init(&workers[i].wake_mutex, NULL);
+    pthread_cond_init(&workers[i].wake, NULL);
+    pthread_create(&workers[i].broadcaster, NULL, broadcast_loop, &workers[i]);
+    pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]);
+  }
 
+  ReactorEvent ready[MAX_EVENTS];
   while (1) {
-    if ((new_socket = accept(server_fd, (struct sockaddr *)&address,
-                             (socklen_t *)&addrlen)) < 0) {
-      perror("accept");
-      continue;
+    int n = reactor_wait(ready, MAX_EVENTS);
+    for (int i = 0; i < n; i++) {
+      int fd = ready[i].fd;
+      if (fd == server_fd) {
+        if ((new_socket = accept(server_fd, (struct sockaddr *)&address,
+                                 (socklen_t *)&addrlen)) < 0) {
+          log_error("accept: %s", strerror(errno));
+          continue;
+        }
+        log_info("New connection accepted");
+        open_connection(new_socket);
+      } else if (fd == discovery_socket) {
+        handle_discovery(discovery_socket);
+      } else if (fd == udp_socket) {
+        handle_udp(udp_socket);
+      } else if (fd == stats_socket) {
+        handle_stats(stats_socket);
+      } else if (fd == shutdown_pipe[0]) {
+        shutdown_server();
+      } else if (fd < connections_capacity && connections[fd].open) {
+        if (ready[i].events & REACTOR_WRITABLE) {
+          handle_writable(fd);
+        }
+        if ((ready[i].events & REACTOR_READABLE) && connections[fd].open) {
+          handle_client(fd);
+        }
+      }
     }
-
-    printf("New connection accepted\n");
-
-    pthread_t client_thread;
-    pthread_create(&client_thread, NULL, (void *(*)(void *))handle_client,
-                   (void *)(intptr_t)new_socket);
   }
   cleanup_game();
   return 0;
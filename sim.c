@@ -0,0 +1,929 @@
+#include "sim.h"
+
+#include "log.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Simulation timers count ticks; durations are converted at the sim's tick
+// rate and never round down to zero.
+unsigned long sim_seconds_to_ticks(const Sim *sim, double seconds) {
+  unsigned long ticks = seconds * sim->tick_rate + 0.5;
+  return ticks > 0 ? ticks : 1;
+}
+
+// Per-tick distances and turn rates are tuned for DEFAULT_TICK_RATE
+float tick_scale(const Sim *sim) {
+  return (float)DEFAULT_TICK_RATE / sim->tick_rate;
+}
+
+// xorshift32, so every sim draws from its own reproducible sequence
+uint32_t sim_rand(Sim *sim) {
+  uint32_t x = sim->rng_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return sim->rng_state = x;
+}
+
+// Hands out a chunk: a freed one if there is one, else the next one of the
+// slabs, allocating a slab only when every one is carved up. NULL when out
+// of memory.
+PathChunk *takeChunk(PathArena *arena) {
+  PathChunk *chunk = arena->free_chunks;
+  if (chunk != NULL) {
+    arena->free_chunks = chunk->next_free;
+    return chunk;
+  }
+  if (arena->current == NULL || arena->next_chunk == PATH_SLAB_CHUNKS) {
+    PathSlab *next = arena->current ? arena->current->next : arena->slabs;
+    if (next == NULL) {
+      next = aligned_alloc(_Alignof(PathSlab), sizeof(PathSlab));
+      if (next == NULL) {
+        return NULL;
+      }
+      next->next = NULL;
+      if (arena->current != NULL) {
+        arena->current->next = next;
+      } else {
+        arena->slabs = next;
+      }
+    }
+    arena->current = next;
+    arena->next_chunk = 0;
+  }
+  return &arena->current->chunks[arena->next_chunk++];
+}
+
+// Gives worm's chunks back to the arena. Its chunk table and grid are kept.
+void cleanupWorm(Sim *sim, Worm *worm) {
+  for (int i = 0; i < worm->num_chunks; i++) {
+    worm->chunks[i]->next_free = sim->paths.free_chunks;
+    sim->paths.free_chunks = worm->chunks[i];
+  }
+  worm->num_chunks = 0;
+  worm->path_length = 0;
+}
+
+void setPathPoint(Worm *worm, int i, Point point) {
+  PathChunk *chunk = worm->chunks[i / PATH_CHUNK_POINTS];
+  chunk->x[i % PATH_CHUNK_POINTS] = point.x;
+  chunk->y[i % PATH_CHUNK_POINTS] = point.y;
+}
+
+void sim_copy_path(const Worm *worm, int start, int end, Point *out) {
+  while (start < end) {
+    const PathChunk *chunk = worm->chunks[start / PATH_CHUNK_POINTS];
+    int offset = start % PATH_CHUNK_POINTS;
+    int count = PATH_CHUNK_POINTS - offset;
+    if (count > end - start) {
+      count = end - start;
+    }
+    for (int i = 0; i < count; i++) {
+      out[i] = (Point){chunk->x[offset + i], chunk->y[offset + i]};
+    }
+    out += count;
+    start += count;
+  }
+}
+
+int gridCellX(float x) {
+  int cx = (int)(x / GRID_CELL_SIZE);
+  return cx < 0 ? 0 : (cx >= GRID_COLS ? GRID_COLS - 1 : cx);
+}
+
+int gridCellY(float y) {
+  int cy = (int)(y / GRID_CELL_SIZE);
+  return cy < 0 ? 0 : (cy >= GRID_ROWS ? GRID_ROWS - 1 : cy);
+}
+
+// Segments longer than half the screen are the jump made when a worm wraps
+// around an edge; they are not part of the visible body.
+bool isWrapSegment(Point a, Point b) {
+  return fabsf(b.x - a.x) > SCREEN_WIDTH / 2.0 ||
+         fabsf(b.y - a.y) > SCREEN_HEIGHT / 2.0;
+}
+
+float pointSegmentDistanceSquared(Point p, Point a, Point b) {
+  float abx = b.x - a.x;
+  float aby = b.y - a.y;
+  float length_sq = abx * abx + aby * aby;
+  float t = 0;
+  if (length_sq > 0) {
+    t = ((p.x - a.x) * abx + (p.y - a.y) * aby) / length_sq;
+    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+  }
+  float dx = p.x - (a.x + t * abx);
+  float dy = p.y - (a.y + t * aby);
+  return dx * dx + dy * dy;
+}
+
+float cross(Point o, Point a, Point b) {
+  return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+}
+
+float segmentDistanceSquared(Point p0, Point p1, Point q0, Point q1) {
+  float d1 = cross(p0, p1, q0);
+  float d2 = cross(p0, p1, q1);
+  float d3 = cross(q0, q1, p0);
+  float d4 = cross(q0, q1, p1);
+  if (((d1 < 0 && d2 > 0) || (d1 > 0 && d2 < 0)) &&
+      ((d3 < 0 && d4 > 0) || (d3 > 0 && d4 < 0))) {
+    return 0;
+  }
+
+  float best = pointSegmentDistanceSquared(p0, q0, q1);
+  float d = pointSegmentDistanceSquared(p1, q0, q1);
+  best = d < best ? d : best;
+  d = pointSegmentDistanceSquared(q0, p0, p1);
+  best = d < best ? d : best;
+  d = pointSegmentDistanceSquared(q1, p0, p1);
+  return d < best ? d : best;
+}
+
+// Registers segment `index` in every cell its bounding box touches. The
+// segment may already be registered when it was just extended by a merge; it
+// is then always the last entry of the cell.
+void gridInsertSegment(Worm *worm, int index) {
+  Point a = sim_path_point(worm, index);
+  Point b = sim_path_point(worm, index + 1);
+  if (isWrapSegment(a, b)) {
+    return;
+  }
+
+  int x0 = gridCellX(fminf(a.x, b.x)), x1 = gridCellX(fmaxf(a.x, b.x));
+  int y0 = gridCellY(fminf(a.y, b.y)), y1 = gridCellY(fmaxf(a.y, b.y));
+  for (int cy = y0; cy <= y1; cy++) {
+    for (int cx = x0; cx <= x1; cx++) {
+      GridCell *cell = &worm->grid[cy * GRID_COLS + cx];
+      if (cell->count > 0 && cell->indices[cell->count - 1] == index) {
+        continue;
+      }
+      if (cell->count >= cell->capacity) {
+        int capacity = cell->capacity ? cell->capacity * 2 : 8;
+        int *indices = realloc(cell->indices, capacity * sizeof(int));
+        if (indices == NULL) {
+          continue; // Out of memory: this cell misses the segment
+        }
+        cell->indices = indices;
+        cell->capacity = capacity;
+      }
+      cell->indices[cell->count++] = index;
+    }
+  }
+}
+
+// Whether any segment (x[i], y[i]) -> (x[i + 1], y[i + 1]), i < count,
+// comes within sqrt(limit_sq) of the segment from -> to. Vector kernels
+// take only runs of at least their number of lanes.
+typedef bool (*SegmentKernel)(const float *x, const float *y, int count,
+                              Point from, Point to, float limit_sq);
+
+bool segmentsHitScalar(const float *x, const float *y, int count, Point from,
+                       Point to, float limit_sq) {
+  for (int i = 0; i < count; i++) {
+    if (segmentDistanceSquared(from, to, (Point){x[i], y[i]},
+                               (Point){x[i + 1], y[i + 1]}) < limit_sq) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_KERNELS
+
+typedef float Float4 __attribute__((vector_size(16)));
+typedef int32_t Int4 __attribute__((vector_size(16)));
+typedef float Float8 __attribute__((vector_size(32)));
+typedef int32_t Int8 __attribute__((vector_size(32)));
+
+// segmentsHitScalar LANES segments at a time, over vectors F with lane
+// masks I. Each lane does the scalar code's operations in the same order
+// and every ?: becomes a select between both sides, so a lane's distance
+// is bit-for-bit the scalar one; -std=c11 keeps the compiler from fusing
+// a * b + c. count must be at least LANES: shorter runs are left to the
+// scalar kernel by the caller, as running scalar SSE code in between
+// AVX2 instructions costs far more than it saves.
+#define DEFINE_SEGMENT_KERNEL(NAME, F, I, LANES, ATTR)                         \
+  ATTR static inline F NAME##Select(I mask, F a, F b) {                        \
+    return (F)((mask & (I)a) | (~mask & (I)b));                                \
+  }                                                                            \
+                                                                               \
+  ATTR static inline F NAME##Cross(F ox, F oy, F ax, F ay, F bx, F by) {       \
+    return (ax - ox) * (by - oy) - (ay - oy) * (bx - ox);                      \
+  }                                                                            \
+                                                                               \
+  ATTR static inline F NAME##PointDistance(F px, F py, F ax, F ay, F bx,      \
+                                           F by) {                             \
+    F zero = {0};                                                              \
+    F one = zero + 1.0f;                                                       \
+    F abx = bx - ax;                                                           \
+    F aby = by - ay;                                                           \
+    F length_sq = abx * abx + aby * aby;                                       \
+    F t = ((px - ax) * abx + (py - ay) * aby) / length_sq;                     \
+    t = NAME##Select(t < 0.0f, zero, NAME##Select(t > 1.0f, one, t));          \
+    t = NAME##Select(length_sq > 0.0f, t, zero);                               \
+    F dx = px - (ax + t * abx);                                                \
+    F dy = py - (ay + t * aby);                                                \
+    return dx * dx + dy * dy;                                                  \
+  }                                                                            \
+                                                                               \
+  ATTR static bool NAME(const float *x, const float *y, int count,             \
+                        Point from, Point to, float limit_sq) {                \
+    F zero = {0};                                                              \
+    F p0x = zero + from.x, p0y = zero + from.y;                                \
+    F p1x = zero + to.x, p1y = zero + to.y;                                    \
+    for (int i = 0;; i += LANES) {                                             \
+      if (i > count - LANES) {                                                 \
+        i = count - LANES; /* The last vector overlaps the one before */       \
+      }                                                                        \
+      F ax, ay, bx, by;                                                        \
+      memcpy(&ax, x + i, sizeof(F));                                           \
+      memcpy(&ay, y + i, sizeof(F));                                           \
+      memcpy(&bx, x + i + 1, sizeof(F));                                       \
+      memcpy(&by, y + i + 1, sizeof(F));                                       \
+      F d1 = NAME##Cross(p0x, p0y, p1x, p1y, ax, ay);                          \
+      F d2 = NAME##Cross(p0x, p0y, p1x, p1y, bx, by);                          \
+      F d3 = NAME##Cross(ax, ay, bx, by, p0x, p0y);                            \
+      F d4 = NAME##Cross(ax, ay, bx, by, p1x, p1y);                            \
+      I crossing = (((d1 < 0.0f) & (d2 > 0.0f)) | ((d1 > 0.0f) & (d2 < 0.0f))) \
+                   & (((d3 < 0.0f) & (d4 > 0.0f)) |                            \
+                      ((d3 > 0.0f) & (d4 < 0.0f)));                            \
+      F best = NAME##PointDistance(p0x, p0y, ax, ay, bx, by);                  \
+      F d = NAME##PointDistance(p1x, p1y, ax, ay, bx, by);                     \
+      best = NAME##Select(d < best, d, best);                                  \
+      d = NAME##PointDistance(ax, ay, p0x, p0y, p1x, p1y);                     \
+      best = NAME##Select(d < best, d, best);                                  \
+      d = NAME##PointDistance(bx, by, p0x, p0y, p1x, p1y);                     \
+      best = NAME##Select(d < best, d, best);                                  \
+      I hits = NAME##Select(crossing, zero, best) < limit_sq;                  \
+      for (int lane = 0; lane < LANES; lane++) {                               \
+        if (hits[lane]) {                                                      \
+          return true;                                                         \
+        }                                                                      \
+      }                                                                        \
+      if (i == count - LANES) {                                                \
+        return false;                                                          \
+      }                                                                        \
+    }                                                                          \
+  }
+
+DEFINE_SEGMENT_KERNEL(segmentsHitSse2, Float4, Int4, 4, )
+DEFINE_SEGMENT_KERNEL(segmentsHitAvx2, Float8, Int8, 8,
+                      __attribute__((target("avx2"))))
+#endif
+
+// Set once, on whichever thread first calls sim_init or sim_use_kernel, and
+// only read after that unless a tool switches kernels
+static SegmentKernel segment_kernel = segmentsHitScalar;
+static int kernel_lanes = 1;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+const char *sim_kernel_name(SimKernel kernel) {
+  static const char *names[SIM_NUM_KERNELS] = {"scalar", "sse2", "avx2"};
+  return (unsigned)kernel < SIM_NUM_KERNELS ? names[kernel] : "unknown";
+}
+
+static bool set_kernel(SimKernel kernel) {
+  switch (kernel) {
+  case SIM_KERNEL_SCALAR:
+    segment_kernel = segmentsHitScalar;
+    kernel_lanes = 1;
+    break;
+#ifdef HAVE_X86_KERNELS
+  case SIM_KERNEL_SSE2: // Part of every x86-64 CPU
+    segment_kernel = segmentsHitSse2;
+    kernel_lanes = 4;
+    break;
+  case SIM_KERNEL_AVX2:
+    if (!__builtin_cpu_supports("avx2")) {
+      return false;
+    }
+    segment_kernel = segmentsHitAvx2;
+    kernel_lanes = 8;
+    break;
+#endif
+  default:
+    return false;
+  }
+  return true;
+}
+
+// A grid cell seldom holds a run of 8 segments for AVX2 to take, and
+// sim_bench measures SSE2 fastest on the worlds the game makes
+static void choose_default_kernel() { set_kernel(SIM_KERNEL_SSE2); }
+
+bool sim_use_kernel(SimKernel kernel) {
+  pthread_once(&kernel_once, choose_default_kernel);
+  return set_kernel(kernel);
+}
+
+// Returns true if the head capsule swept from `from` to `to` touches the body
+// of worm. Segments before end_segment are tested whole; segment end_segment
+// is clipped to its first end_fraction. Only the cells under the capsule's
+// bounding box are probed. A curving body puts runs of consecutive segments
+// in a cell, whose points lie next to each other in a chunk; those go to
+// the segment kernel in one call.
+bool gridQuery(const Worm *worm, Point from, Point to, int end_segment,
+               float end_fraction) {
+  const float hit = WORM_RADIUS * 2;
+  int x0 = gridCellX(fminf(from.x, to.x) - hit);
+  int x1 = gridCellX(fmaxf(from.x, to.x) + hit);
+  int y0 = gridCellY(fminf(from.y, to.y) - hit);
+  int y1 = gridCellY(fmaxf(from.y, to.y) + hit);
+
+  for (int cy = y0; cy <= y1; cy++) {
+    for (int cx = x0; cx <= x1; cx++) {
+      GridCell *cell = &worm->grid[cy * GRID_COLS + cx];
+      int k = 0;
+      while (k < cell->count) {
+        int j = cell->indices[k];
+        if (j > end_segment || (j == end_segment && end_fraction <= 0)) {
+          break; // Indices are appended in increasing order
+        }
+        // The run stops short of end_segment, which may be clipped, and of
+        // the segment reaching into the next chunk
+        int offset = j % PATH_CHUNK_POINTS;
+        int limit = j - offset + PATH_CHUNK_POINTS - 1;
+        limit = end_segment < limit ? end_segment : limit;
+        int run = 0;
+        while (k + run < cell->count && cell->indices[k + run] == j + run &&
+               j + run < limit) {
+          run++;
+        }
+        if (run > 0) {
+          const PathChunk *chunk = worm->chunks[j / PATH_CHUNK_POINTS];
+          SegmentKernel kernel =
+              run >= kernel_lanes ? segment_kernel : segmentsHitScalar;
+          if (kernel(chunk->x + offset, chunk->y + offset, run, from, to,
+                     hit * hit)) {
+            return true;
+          }
+          k += run;
+          continue;
+        }
+
+        Point a = sim_path_point(worm, j);
+        Point b = sim_path_point(worm, j + 1);
+        if (j == end_segment) {
+          b.x = a.x + (b.x - a.x) * end_fraction;
+          b.y = a.y + (b.y - a.y) * end_fraction;
+        }
+        if (segmentDistanceSquared(from, to, a, b) < hit * hit) {
+          return true;
+        }
+        k++;
+      }
+    }
+  }
+  return false;
+}
+
+void initWorm(Sim *sim, Worm *worm, float startX, float startY, float angle) {
+  worm->id = ++sim->next_worm_id;
+  worm->position.x = startX;
+  worm->position.y = startY;
+  worm->angle = angle;
+  worm->alive = true;
+  worm->num_chunks = 0;
+  worm->path_length = 0;
+  addPointToPath(sim, worm, (Point){startX, startY});
+  if (worm->grid == NULL) {
+    worm->grid = calloc(GRID_COLS * GRID_ROWS, sizeof(GridCell));
+  } else {
+    for (int i = 0; i < GRID_COLS * GRID_ROWS; i++) {
+      worm->grid[i].count = 0; // The index arrays stay for this worm
+    }
+  }
+  worm->bullets_left = 0;
+  for (int i = 0; i < MAX_BULLETS; i++) {
+    worm->bullets[i].active = false;
+  }
+  worm->invincible_until =
+      sim->current_tick + sim_seconds_to_ticks(sim, INVINCIIBILITY_TIME);
+  worm->speed_boost_time_left = 0;
+  worm->speed_boost_active = false;
+  worm->last_shot_tick = 0;
+  worm->is_ghost = false;
+}
+
+// Appends newPoint to the worm's polyline. When the last vertex lies on the
+// straight line to newPoint it is moved there instead, so straight runs are
+// stored as a single segment however long they get.
+void addPointToPath(Sim *sim, Worm *worm, Point newPoint) {
+  int n = worm->path_length;
+  if (n >= 2) {
+    Point a = sim_path_point(worm, n - 2);
+    Point b = sim_path_point(worm, n - 1);
+    float dx = newPoint.x - a.x;
+    float dy = newPoint.y - a.y;
+    if (!isWrapSegment(a, b) && !isWrapSegment(b, newPoint) &&
+        (b.x - a.x) * (newPoint.x - b.x) + (b.y - a.y) * (newPoint.y - b.y) >
+            0 &&
+        fabsf(cross(a, newPoint, b)) <=
+            PATH_MERGE_TOLERANCE * sqrtf(dx * dx + dy * dy)) {
+      setPathPoint(worm, n - 1, newPoint);
+      gridInsertSegment(worm, n - 2);
+      return;
+    }
+  }
+
+  if (n == worm->num_chunks * PATH_CHUNK_POINTS) {
+    if (worm->num_chunks == worm->chunk_capacity) {
+      int capacity = worm->chunk_capacity ? worm->chunk_capacity * 2 : 8;
+      PathChunk **chunks =
+          realloc(worm->chunks, capacity * sizeof(PathChunk *));
+      if (chunks == NULL) {
+        return;
+      }
+      worm->chunks = chunks;
+      worm->chunk_capacity = capacity;
+    }
+    PathChunk *chunk = takeChunk(&sim->paths);
+    if (chunk == NULL) {
+      return; // Out of memory: the path stops growing
+    }
+    worm->chunks[worm->num_chunks++] = chunk;
+  }
+  setPathPoint(worm, worm->path_length++, newPoint);
+  if (n >= 1) {
+    gridInsertSegment(worm, n - 1);
+  }
+}
+
+// The last TAIL_COLLISION_DISTANCE of body behind the head can never be hit by
+// it. Walks back along the path from the head to find where the rest starts.
+bool checkTailCollision(const Worm *worm, Point from, Point to) {
+  if (worm->path_length < 2) {
+    return false;
+  }
+
+  float remaining = TAIL_COLLISION_DISTANCE -
+                    sqrtf((to.x - from.x) * (to.x - from.x) +
+                          (to.y - from.y) * (to.y - from.y));
+
+  for (int s = worm->path_length - 2; s >= 0; s--) {
+    Point a = sim_path_point(worm, s);
+    Point b = sim_path_point(worm, s + 1);
+    float dx = fabsf(b.x - a.x);
+    float dy = fabsf(b.y - a.y);
+    dx = fminf(dx, SCREEN_WIDTH - dx);
+    dy = fminf(dy, SCREEN_HEIGHT - dy);
+    float length = sqrtf(dx * dx + dy * dy);
+    if (length > remaining) {
+      return gridQuery(worm, from, to, s, (length - remaining) / length);
+    }
+    remaining -= length;
+  }
+  return false;
+}
+
+bool checkCollision(const Sim *sim, const Worm *worm, Point from, Point to) {
+  if (sim->current_tick < worm->invincible_until) {
+    return false;
+  }
+
+  if (checkTailCollision(worm, from, to)) {
+    return true;
+  }
+
+  // Check collision with other worms
+  for (int i = 0; i < sim->num_worms; i++) {
+    const Worm *otherWorm = &sim->worms[i];
+    if (otherWorm == worm || !otherWorm->alive)
+      continue;
+
+    if (otherWorm->path_length >= 2 &&
+        gridQuery(otherWorm, from, to, otherWorm->path_length - 2, 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void spawnPowerup(Sim *sim) {
+  if (sim->active_powerups < MAX_POWERUPS) {
+    Powerup new_powerup;
+    new_powerup.position.x = sim_rand(sim) % SCREEN_WIDTH;
+    new_powerup.position.y = sim_rand(sim) % SCREEN_HEIGHT;
+    new_powerup.active = true;
+    uint8_t new_type = sim_rand(sim) % 3;
+    if (new_type == POWERUP_BULLETS) {
+      new_powerup.type = POWERUP_BULLETS;
+    } else if (new_type == POWERUP_SPEED) {
+      new_powerup.type = POWERUP_SPEED;
+    } else {
+      new_powerup.type = POWERUP_GHOST;
+    }
+    sim->powerups[sim->active_powerups++] = new_powerup;
+    log_debug("Spawned powerup of type: %d at position (%.2f, %.2f)",
+              new_powerup.type, new_powerup.position.x,
+              new_powerup.position.y);
+  }
+}
+
+void updateBullets(const Sim *sim, Bullet *bullets) {
+  for (int i = 0; i < MAX_BULLETS; i++) {
+    if (bullets[i].active) {
+      float speed = BULLET_SPEED * tick_scale(sim);
+      bullets[i].position.x += cos(bullets[i].angle) * speed;
+      bullets[i].position.y += sin(bullets[i].angle) * speed;
+
+      // Check if bullet is out of bounds
+      if (bullets[i].position.x < 0 || bullets[i].position.x > SCREEN_WIDTH ||
+          bullets[i].position.y < 0 || bullets[i].position.y > SCREEN_HEIGHT) {
+        bullets[i].active = false;
+      }
+    }
+  }
+}
+
+bool checkBulletCollision(Point bullet_pos, const Worm *target_worm) {
+  float dx = bullet_pos.x - target_worm->position.x;
+  float dy = bullet_pos.y - target_worm->position.y;
+  float distance = sqrt(dx * dx + dy * dy);
+  return distance < (WORM_RADIUS + BULLET_RADIUS);
+}
+
+float sim_turn(float angle, uint8_t input, int tick_rate) {
+  float scale = (float)DEFAULT_TICK_RATE / tick_rate;
+  if (input & SIM_INPUT_LEFT) {
+    angle -= TURN_SPEED * scale;
+  }
+  if (input & SIM_INPUT_RIGHT) {
+    angle += TURN_SPEED * scale;
+  }
+  return angle;
+}
+
+Point sim_move_head(Point position, float angle, float speed, Point *step) {
+  *step = (Point){cos(angle) * speed, sin(angle) * speed};
+  Point next = {position.x + step->x, position.y + step->y};
+  next.x = fmod(next.x + SCREEN_WIDTH, SCREEN_WIDTH);
+  next.y = fmod(next.y + SCREEN_HEIGHT, SCREEN_HEIGHT);
+  return next;
+}
+
+void sim_plan_worm(const Sim *sim, int index, uint8_t input, WormPlan *plan) {
+  const Worm *worm = &sim->worms[index];
+  plan->moved = worm->alive;
+  if (!worm->alive)
+    return;
+
+  plan->angle = sim_turn(worm->angle, input, sim->tick_rate);
+  plan->bullets_left = worm->bullets_left;
+  memcpy(plan->bullets, worm->bullets, sizeof(plan->bullets));
+  plan->speed_boost_time_left = worm->speed_boost_time_left;
+  plan->speed_boost_active = worm->speed_boost_active;
+  plan->is_ghost = worm->is_ghost;
+  plan->last_shot_tick = worm->last_shot_tick;
+
+  float current_speed = WORM_SPEED * tick_scale(sim);
+  if (input & SIM_INPUT_UP) {
+    if (plan->speed_boost_time_left > 0) {
+      current_speed *= SPEED_BOOST_MULTIPLIER;
+      plan->speed_boost_time_left -= 1.0 / sim->tick_rate;
+      if (plan->speed_boost_time_left <= 0) {
+        plan->speed_boost_time_left = 0;
+      }
+    } else if (plan->bullets_left > 0 &&
+               sim->current_tick - plan->last_shot_tick >=
+                   sim_seconds_to_ticks(sim, BULLET_COOLDOWN)) {
+      // Shoot a bullet
+      for (int i = 0; i < MAX_BULLETS; i++) {
+        if (!plan->bullets[i].active) {
+          plan->bullets[i].position = worm->position;
+          plan->bullets[i].angle = plan->angle;
+          plan->bullets[i].active = true;
+          plan->bullets_left--;
+          plan->last_shot_tick = sim->current_tick;
+          log_debug("Bullet fired by worm %d. Bullets left: %d", index,
+                    plan->bullets_left);
+          break;
+        }
+      }
+    }
+  } else {
+    plan->speed_boost_active = false;
+    plan->is_ghost = false;
+  }
+
+  Point step;
+  plan->position =
+      sim_move_head(worm->position, plan->angle, current_speed, &step);
+
+  // Sweep the head over this tick's whole step so fast worms cannot pass
+  // between samples of a body. After a wrap the sweep starts off-screen.
+  plan->sweep_from =
+      (Point){plan->position.x - step.x, plan->position.y - step.y};
+  plan->collided =
+      !plan->is_ghost &&
+      checkCollision(sim, worm, plan->sweep_from, plan->position);
+  if (plan->collided) {
+    log_debug(checkTailCollision(worm, plan->sweep_from, plan->position)
+                  ? "Worm %d collided with its own tail!"
+                  : "Worm %d collided and died!",
+              index);
+  }
+
+  updateBullets(sim, plan->bullets);
+}
+
+void applyPowerup(Worm *worm, PowerupType type) {
+  if (type == POWERUP_BULLETS) {
+    worm->bullets_left = 3;
+    worm->speed_boost_time_left = 0;
+    worm->speed_boost_active = false;
+    worm->is_ghost = false;
+  } else if (type == POWERUP_SPEED) {
+    worm->speed_boost_time_left = SPEED_BOOST_DURATION;
+    worm->bullets_left = 0;
+    worm->is_ghost = false;
+  } else if (type == POWERUP_GHOST) {
+    worm->is_ghost = true;
+    worm->speed_boost_time_left = 0;
+    worm->bullets_left = 0;
+  }
+}
+
+// Whether the heads of two plans swept within a hit of each other. Most
+// pairs are far apart, so their bounding boxes rule them out cheaply.
+bool sweepsMeet(const WormPlan *a, const WormPlan *b) {
+  const float hit = WORM_RADIUS * 2;
+  if (fminf(a->sweep_from.x, a->position.x) - hit >
+          fmaxf(b->sweep_from.x, b->position.x) ||
+      fminf(b->sweep_from.x, b->position.x) - hit >
+          fmaxf(a->sweep_from.x, a->position.x) ||
+      fminf(a->sweep_from.y, a->position.y) - hit >
+          fmaxf(b->sweep_from.y, b->position.y) ||
+      fminf(b->sweep_from.y, b->position.y) - hit >
+          fmaxf(a->sweep_from.y, a->position.y)) {
+    return false;
+  }
+  return segmentDistanceSquared(a->sweep_from, a->position, b->sweep_from,
+                                b->position) < hit * hit;
+}
+
+void sim_apply_plans(Sim *sim, const WormPlan *plans) {
+  Worm *worms = sim->worms;
+  bool dies[SIM_MAX_WORMS];
+  for (int i = 0; i < sim->num_worms; i++) {
+    dies[i] = plans[i].moved && plans[i].collided;
+  }
+
+  // The plans saw the bodies as they were before anyone moved, so two
+  // heads that met this tick have not hit each other yet. Both die,
+  // whichever comes first in worms[], unless a ghost or still invincible.
+  for (int i = 0; i < sim->num_worms; i++) {
+    for (int j = i + 1; j < sim->num_worms; j++) {
+      if (!plans[i].moved || !plans[j].moved ||
+          !sweepsMeet(&plans[i], &plans[j])) {
+        continue;
+      }
+      int pair[2] = {i, j};
+      for (int k = 0; k < 2; k++) {
+        int w = pair[k];
+        if (!plans[w].is_ghost &&
+            sim->current_tick >= worms[w].invincible_until && !dies[w]) {
+          dies[w] = true;
+          log_debug("Worm %d met worm %d head-on and died!", w,
+                    pair[1 - k]);
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < sim->num_worms; i++) {
+    const WormPlan *plan = &plans[i];
+    if (!plan->moved) {
+      continue;
+    }
+    Worm *worm = &worms[i];
+    worm->angle = plan->angle;
+    worm->bullets_left = plan->bullets_left;
+    memcpy(worm->bullets, plan->bullets, sizeof(worm->bullets));
+    worm->speed_boost_time_left = plan->speed_boost_time_left;
+    worm->speed_boost_active = plan->speed_boost_active;
+    worm->is_ghost = plan->is_ghost;
+    worm->last_shot_tick = plan->last_shot_tick;
+    if (dies[i]) {
+      worm->alive = false;
+      cleanupWorm(sim, worm);
+    } else {
+      worm->position = plan->position;
+      addPointToPath(sim, worm, plan->position);
+    }
+  }
+
+  // Each powerup goes to the nearest head that reached it, the lower index
+  // on a tie
+  for (int p = 0; p < sim->active_powerups;) {
+    int taker = -1;
+    float nearest = POWERUP_RADIUS + WORM_RADIUS;
+    for (int i = 0; i < sim->num_worms; i++) {
+      if (worms[i].alive) {
+        float dx = worms[i].position.x - sim->powerups[p].position.x;
+        float dy = worms[i].position.y - sim->powerups[p].position.y;
+        float distance = sqrt(dx * dx + dy * dy);
+        if (distance < nearest) {
+          nearest = distance;
+          taker = i;
+        }
+      }
+    }
+    if (taker < 0) {
+      p++;
+      continue;
+    }
+    applyPowerup(&worms[taker], sim->powerups[p].type);
+    log_debug("Worm %d collected a powerup! Type: %d", taker,
+              sim->powerups[p].type);
+    // Move last active powerup to this slot and decrease count
+    sim->powerups[p] = sim->powerups[--sim->active_powerups];
+  }
+
+  // Every bullet is checked against the heads that survived their moves
+  // and is spent on the nearest one it hits, the lower index on a tie. The
+  // worms hit die together once all bullets have flown.
+  bool shot[SIM_MAX_WORMS] = {false};
+  for (int i = 0; i < sim->num_worms; i++) {
+    if (!plans[i].moved) {
+      continue;
+    }
+    Bullet *bullets = worms[i].bullets;
+    for (int b = 0; b < MAX_BULLETS; b++) {
+      if (!bullets[b].active) {
+        continue;
+      }
+      int target = -1;
+      float nearest = 0;
+      for (int j = 0; j < sim->num_worms; j++) {
+        if (j != i && worms[j].alive &&
+            checkBulletCollision(bullets[b].position, &worms[j])) {
+          float dx = worms[j].position.x - bullets[b].position.x;
+          float dy = worms[j].position.y - bullets[b].position.y;
+          float distance = sqrt(dx * dx + dy * dy);
+          if (target < 0 || distance < nearest) {
+            nearest = distance;
+            target = j;
+          }
+        }
+      }
+      if (target >= 0) {
+        shot[target] = true;
+        bullets[b].active = false;
+        log_debug("Worm %d shot and killed worm %d!", i, target);
+      }
+    }
+  }
+  for (int i = 0; i < sim->num_worms; i++) {
+    if (shot[i]) {
+      worms[i].alive = false;
+      cleanupWorm(sim, &worms[i]);
+    }
+  }
+}
+
+void sim_init(Sim *sim, uint32_t seed, int tick_rate) {
+  pthread_once(&kernel_once, choose_default_kernel);
+  memset(sim, 0, sizeof(*sim));
+  sim->tick_rate = tick_rate;
+  sim_reset(sim, seed);
+}
+
+void sim_reset(Sim *sim, uint32_t seed) {
+  for (int i = 0; i < sim->num_worms; i++) {
+    sim->worms[i].num_chunks = 0;
+    sim->worms[i].path_length = 0;
+  }
+  sim->num_worms = 0;
+  sim->paths.current = NULL; // Every chunk is free again
+  sim->paths.next_chunk = 0;
+  sim->paths.free_chunks = NULL;
+  sim->active_powerups = 0;
+  sim->last_powerup_spawn = 0;
+  sim->current_tick = 0;
+  sim->rng_state = seed != 0 ? seed : 1; // xorshift32 sticks at zero
+}
+
+void sim_free(Sim *sim) {
+  for (int i = 0; i < SIM_MAX_WORMS; i++) {
+    Worm *worm = &sim->worms[i];
+    if (worm->grid != NULL) {
+      for (int j = 0; j < GRID_COLS * GRID_ROWS; j++) {
+        free(worm->grid[j].indices);
+      }
+      free(worm->grid);
+      worm->grid = NULL;
+    }
+    free(worm->chunks);
+    worm->chunks = NULL;
+    worm->num_chunks = 0;
+    worm->chunk_capacity = 0;
+    worm->path_length = 0;
+  }
+  sim->num_worms = 0;
+  while (sim->paths.slabs != NULL) {
+    PathSlab *next = sim->paths.slabs->next;
+    free(sim->paths.slabs);
+    sim->paths.slabs = next;
+  }
+  memset(&sim->paths, 0, sizeof(sim->paths));
+}
+
+int sim_add_worm(Sim *sim) {
+  if (sim->num_worms >= SIM_MAX_WORMS) {
+    return -1;
+  }
+  int index = sim->num_worms;
+  float angle = (2 * PI * index) / SIM_MAX_WORMS;
+  float startX = SCREEN_WIDTH / 2.0 + SPAWN_CIRCLE_RADIUS * cos(angle);
+  float startY = SCREEN_HEIGHT / 2.0 + SPAWN_CIRCLE_RADIUS * sin(angle);
+  float spawnAngle = angle;
+  spawnAngle += ((sim_rand(sim) % 200) / 100.0) - 1.0;
+
+  initWorm(sim, &sim->worms[index], startX, startY, spawnAngle);
+  sim->num_worms++;
+  return index;
+}
+
+void sim_remove_worm(Sim *sim, int index) {
+  cleanupWorm(sim, &sim->worms[index]);
+  Worm removed = sim->worms[index];
+  for (int i = index; i < sim->num_worms - 1; i++) {
+    sim->worms[i] = sim->worms[i + 1];
+  }
+  // The slot left empty keeps the removed worm's chunk table and grid
+  sim->worms[sim->num_worms - 1] = removed;
+  sim->num_worms--;
+}
+
+void sim_advance(Sim *sim) {
+  sim->current_tick++;
+
+  // Spawn powerups
+  if (sim->last_powerup_spawn == 0 ||
+      sim->current_tick - sim->last_powerup_spawn >=
+          sim_seconds_to_ticks(sim, POWERUP_SPAWN_INTERVAL)) {
+    spawnPowerup(sim);
+    sim->last_powerup_spawn = sim->current_tick;
+  }
+}
+
+void sim_update_worms(Sim *sim, const uint8_t *inputs) {
+  WormPlan plans[SIM_MAX_WORMS];
+  for (int i = 0; i < sim->num_worms; i++) {
+    sim_plan_worm(sim, i, inputs[i], &plans[i]);
+  }
+  sim_apply_plans(sim, plans);
+}
+
+void sim_step(Sim *sim, const uint8_t *inputs) {
+  sim_advance(sim);
+  sim_update_worms(sim, inputs);
+}
+
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+#define HASH_FIELD(hash, field) hash_bytes(hash, &(field), sizeof(field))
+
+uint32_t sim_hash(const Sim *sim) {
+  uint32_t hash = 2166136261u;
+  hash = HASH_FIELD(hash, sim->current_tick);
+  hash = HASH_FIELD(hash, sim->rng_state);
+  hash = HASH_FIELD(hash, sim->num_worms);
+  hash = HASH_FIELD(hash, sim->active_powerups);
+  for (int i = 0; i < sim->active_powerups; i++) {
+    hash = HASH_FIELD(hash, sim->powerups[i].position);
+    hash = HASH_FIELD(hash, sim->powerups[i].type);
+  }
+  for (int i = 0; i < sim->num_worms; i++) {
+    const Worm *worm = &sim->worms[i];
+    hash = HASH_FIELD(hash, worm->position);
+    hash = HASH_FIELD(hash, worm->angle);
+    hash = HASH_FIELD(hash, worm->alive);
+    hash = HASH_FIELD(hash, worm->path_length);
+    hash = HASH_FIELD(hash, worm->bullets_left);
+    hash = HASH_FIELD(hash, worm->speed_boost_time_left);
+    hash = HASH_FIELD(hash, worm->is_ghost);
+    if (worm->path_length > 0) {
+      Point head = sim_path_point(worm, worm->path_length - 1);
+      hash = HASH_FIELD(hash, head);
+    }
+    for (int j = 0; j < MAX_BULLETS; j++) {
+      if (worm->bullets[j].active) {
+        hash = HASH_FIELD(hash, worm->bullets[j].position);
+      }
+    }
+  }
+  return hash;
+}
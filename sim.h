@@ -0,0 +1,219 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The game rules, with no sockets, threads or clocks. A Sim advances only in
+// sim_step and draws randomness only from its seed, so the same seed and
+// input sequence always play out the same game.
+
+#ifndef SIM_MAX_WORMS // The benchmarks build with more
+#define SIM_MAX_WORMS 6
+#endif
+#define DEFAULT_TICK_RATE 60 // Hz; the per-tick speeds below are for this rate
+#define SCREEN_WIDTH (int)(1024 * 1.2)
+#define SCREEN_HEIGHT (int)(640 * 1.2)
+#define WORM_SPEED 2.0
+#define SPEED_BOOST_MULTIPLIER 3
+#define TURN_SPEED 0.1
+#define WORM_RADIUS 3
+#define PI 3.14159265
+#define MAX_BULLETS 3
+#define BULLET_SPEED 12
+#define POWERUP_SPAWN_INTERVAL 5
+#define MAX_POWERUPS 3
+#define SPAWN_CIRCLE_RADIUS 50
+#define POWERUP_RADIUS 10
+#define BULLET_RADIUS 5
+#define TAIL_COLLISION_THRESHOLD 10
+#define TAIL_COLLISION_DISTANCE (TAIL_COLLISION_THRESHOLD * WORM_SPEED)
+#define PATH_MERGE_TOLERANCE 0.05 // Max deviation (px) of a merged vertex
+#define INVINCIIBILITY_TIME 2
+#define SPEED_BOOST_DURATION 3.0
+#define BULLET_COOLDOWN 0.003
+#define GRID_CELL_SIZE 16
+#define GRID_COLS ((SCREEN_WIDTH + GRID_CELL_SIZE - 1) / GRID_CELL_SIZE)
+#define GRID_ROWS ((SCREEN_HEIGHT + GRID_CELL_SIZE - 1) / GRID_CELL_SIZE)
+#define PATH_CHUNK_POINTS 512 // Points per chunk of a worm's path
+#define PATH_SLAB_CHUNKS 16   // Chunks a PathArena allocates at a time
+
+// Bits of one worm's input for a tick; the wire INPUT_* bits match them
+#define SIM_INPUT_LEFT 0x01
+#define SIM_INPUT_RIGHT 0x02
+#define SIM_INPUT_UP 0x04
+
+typedef struct {
+  float x;
+  float y;
+} Point;
+
+typedef struct {
+  Point position;
+  float angle;
+  bool active;
+} Bullet;
+
+typedef struct {
+  int *indices; // Segments (path[i] -> path[i + 1]) of the owning worm
+  int count;
+  int capacity;
+} GridCell;
+
+// A fixed-size piece of a worm's path. Growing a path adds chunks, so the
+// points already stored never move. The coordinates are kept in separate
+// arrays so the collision kernels load several segments' worth at once.
+typedef union PathChunk {
+  struct {
+    _Alignas(32) float x[PATH_CHUNK_POINTS];
+    _Alignas(32) float y[PATH_CHUNK_POINTS];
+  };
+  union PathChunk *next_free; // While on the arena's free list
+} PathChunk;
+
+typedef struct PathSlab {
+  struct PathSlab *next;
+  PathChunk chunks[PATH_SLAB_CHUNKS];
+} PathSlab;
+
+// Where the paths of one Sim live. Chunks are carved from slabs in order,
+// and those of a worm that dies or leaves go on a free list for the next
+// path to grow into. Slabs are kept until sim_free, and sim_reset takes
+// every chunk back at once by rewinding to the first slab, so once a
+// match has played a round its paths grow without allocating.
+typedef struct {
+  PathSlab *slabs;
+  PathSlab *current; // Slab being carved, NULL before the first
+  int next_chunk;    // First chunk of current not handed out yet
+  PathChunk *free_chunks;
+} PathArena;
+
+typedef enum { POWERUP_BULLETS, POWERUP_SPEED, POWERUP_GHOST } PowerupType;
+
+typedef struct {
+  Point position;
+  PowerupType type;
+  bool active;
+} Powerup;
+
+typedef struct {
+  unsigned int id; // Unique per initWorm call, used to match baselines
+  Point position;
+  float angle;
+  bool alive;
+  // The path; point i is in chunks[i / PATH_CHUNK_POINTS]. The chunk table
+  // and grid stay with the slot when the worm goes, for the next one.
+  PathChunk **chunks;
+  int num_chunks;
+  int chunk_capacity;
+  int path_length;
+  GridCell *grid; // GRID_COLS * GRID_ROWS cells indexing path segments
+  int bullets_left;
+  Bullet bullets[MAX_BULLETS];
+  unsigned long invincible_until; // Tick at which collisions start counting
+  float speed_boost_time_left;
+  bool speed_boost_active;
+  unsigned long last_shot_tick;
+  bool is_ghost;
+} Worm;
+
+// One worm's part of a tick, as sim_plan_worm works it out: where its head
+// goes and what it would run into, with the worm's other state after
+// steering, shooting and moving its bullets.
+typedef struct {
+  bool moved;    // Alive when the tick began; nothing below is set if not
+  bool collided; // The head's sweep touched a body as the tick found them
+  Point sweep_from;
+  Point position;
+  float angle;
+  int bullets_left;
+  Bullet bullets[MAX_BULLETS];
+  float speed_boost_time_left;
+  bool speed_boost_active;
+  bool is_ghost;
+  unsigned long last_shot_tick;
+} WormPlan;
+
+typedef struct {
+  Worm worms[SIM_MAX_WORMS];
+  int num_worms;
+  Powerup powerups[MAX_POWERUPS];
+  int active_powerups;
+  unsigned long last_powerup_spawn;
+  unsigned long current_tick; // Ticks since sim_init or sim_reset
+  int tick_rate;
+  uint32_t rng_state;
+  unsigned int next_worm_id;
+  PathArena paths;
+} Sim;
+
+void sim_init(Sim *sim, uint32_t seed, int tick_rate);
+void sim_reset(Sim *sim, uint32_t seed); // Drops every worm, back to tick 0
+void sim_free(Sim *sim); // Also releases the memory kept for reuse
+uint32_t sim_rand(Sim *sim);
+unsigned long sim_seconds_to_ticks(const Sim *sim, double seconds);
+
+// Spawns a worm on the spawn circle and returns its index, or -1 when full.
+// Removing a worm shifts the ones after it down by one.
+int sim_add_worm(Sim *sim);
+void sim_remove_worm(Sim *sim, int index);
+
+// Advances one tick. inputs[i] holds the SIM_INPUT_* bits of worms[i].
+void sim_step(Sim *sim, const uint8_t *inputs);
+// sim_step's two halves, for callers that time them separately: the clock
+// and powerup spawning, then every worm's movement and collisions.
+void sim_advance(Sim *sim);
+void sim_update_worms(Sim *sim, const uint8_t *inputs);
+
+// sim_update_worms' two phases. sim_plan_worm moves one worm against the
+// Sim as the tick found it and only reads the Sim, so callers with many
+// worms may plan them on as many threads as they like. sim_apply_plans
+// then merges the plans of every worm in one go: heads that met this tick
+// die together, a powerup goes to the nearest head that reached it, and
+// bullets hit the heads where they ended up. No outcome depends on the
+// order of worms[].
+void sim_plan_worm(const Sim *sim, int index, uint8_t input, WormPlan *plan);
+void sim_apply_plans(Sim *sim, const WormPlan *plans);
+
+// FNV-1a over the state a divergence between two runs would show in: the
+// clock, the generator, powerups and each worm's head, heading, path length
+// and bullets. Equal for equal games on the same build.
+uint32_t sim_hash(const Sim *sim);
+
+// sim_plan_worm's steering and movement on their own, so clients can predict
+// their worm with the same rules. sim_turn applies the LEFT and RIGHT bits
+// to a heading. sim_move_head moves a head speed px along angle, wrapping at
+// the screen edges, and stores the unwrapped step.
+float sim_turn(float angle, uint8_t input, int tick_rate);
+Point sim_move_head(Point position, float angle, float speed, Point *step);
+
+static inline Point sim_path_point(const Worm *worm, int i) {
+  const PathChunk *chunk = worm->chunks[i / PATH_CHUNK_POINTS];
+  return (Point){chunk->x[i % PATH_CHUNK_POINTS],
+                 chunk->y[i % PATH_CHUNK_POINTS]};
+}
+// Copies points start..end - 1 of worm's path to out
+void sim_copy_path(const Worm *worm, int start, int end, Point *out);
+
+// The ways gridQuery can test a run of path segments against a head. Each
+// performs segmentDistanceSquared's float operations in the same order, so
+// all of them find exactly the same collisions; the vector ones just test
+// 4 or 8 segments at a time. sim_init picks SSE2 where there is one.
+typedef enum { SIM_KERNEL_SCALAR, SIM_KERNEL_SSE2, SIM_KERNEL_AVX2 } SimKernel;
+#define SIM_NUM_KERNELS 3
+const char *sim_kernel_name(SimKernel kernel);
+// Makes every Sim use kernel from now on. Returns false, changing nothing,
+// if this build or CPU cannot run it. Not thread-safe: it is for tools such
+// as sim_bench, called while no other thread runs a Sim. Without it, the
+// first sim_init picks the default once for the whole process.
+bool sim_use_kernel(SimKernel kernel);
+
+// The pieces sim_step is made of, for tools that drive them directly
+void initWorm(Sim *sim, Worm *worm, float startX, float startY, float angle);
+void cleanupWorm(Sim *sim, Worm *worm);
+void addPointToPath(Sim *sim, Worm *worm, Point newPoint);
+bool checkTailCollision(const Worm *worm, Point from, Point to);
+bool checkCollision(const Sim *sim, const Worm *worm, Point from, Point to);
+void spawnPowerup(Sim *sim);
+
+#endif
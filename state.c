@@ -0,0 +1,120 @@
+#include "state.h"
+
+#include "log.h"
+#include "protocol.h"
+
+#include <stdio.h>
+
+// Text STATE. Each worm carries its total path length and the index of the
+// first point sent; only points from that index onwards follow.
+int build_text_state(const WorldState *world, char *state, size_t size,
+                     const int *path_starts) {
+  int offset = 0;
+  offset += snprintf(state + offset, size - offset, "STATE %u %d ",
+                     world->seq, world->num_worms);
+
+  // Add powerup information
+  offset += snprintf(state + offset, size - offset, "%d ",
+                     world->num_powerups);
+  for (int i = 0; i < world->num_powerups; i++) {
+    const Powerup *powerup = &world->powerups[i];
+    offset += snprintf(state + offset, size - offset, "%.2f %.2f %d ",
+                       powerup->position.x, powerup->position.y,
+                       powerup->type);
+  }
+
+  for (int i = 0; i < world->num_worms; i++) {
+    const WormSnapshot *worm = &world->worms[i];
+    int path_start = path_starts[i];
+    offset += snprintf(state + offset, size - offset,
+                       "%d %.2f %.2f %.2f %d %d %.2f %d %d %u %d ",
+                       worm->path_length, worm->position.x, worm->position.y,
+                       worm->angle, worm->alive ? 1 : 0, worm->bullets_left,
+                       worm->speed_boost_time_left,
+                       worm->speed_boost_active ? 1 : 0,
+                       worm->is_ghost ? 1 : 0, worm->input_seq, path_start);
+
+    // Add bullet information
+    for (int j = 0; j < MAX_BULLETS; j++) {
+      if (worm->bullets[j].active) {
+        offset += snprintf(state + offset, size - offset, "%.2f %.2f %.2f ",
+                           worm->bullets[j].position.x,
+                           worm->bullets[j].position.y, worm->bullets[j].angle);
+      } else {
+        offset += snprintf(state + offset, size - offset, "0 0 0 ");
+      }
+    }
+
+    // Add the path points the client does not have yet
+    for (int j = path_start;
+         j < worm->path_length && offset < (int)size - 1; j++) {
+      const Point *point = &worm->points[j - worm->path_base];
+      offset += snprintf(state + offset, size - offset, "%.2f %.2f ",
+                         point->x, point->y);
+    }
+
+    if (offset >= (int)size - 1) {
+      log_warn("State message truncated");
+      return size - 1;
+    }
+  }
+  return offset;
+}
+
+// Binary encoding of the same STATE, see protocol.h for the field encodings
+int build_binary_state(const WorldState *world, char *state, size_t size,
+                       const int *path_starts) {
+  ByteWriter writer = {(uint8_t *)state, size, 0, false};
+  put_u8(&writer, PROTOCOL_MAGIC);
+  put_u8(&writer, PROTOCOL_VERSION);
+  put_varint(&writer, world->seq);
+  put_varint(&writer, world->num_worms);
+
+  put_varint(&writer, world->num_powerups);
+  for (int i = 0; i < world->num_powerups; i++) {
+    put_coord(&writer, world->powerups[i].position.x);
+    put_coord(&writer, world->powerups[i].position.y);
+    put_u8(&writer, world->powerups[i].type);
+  }
+
+  for (int i = 0; i < world->num_worms; i++) {
+    const WormSnapshot *worm = &world->worms[i];
+    uint8_t flags = (worm->alive ? WORM_FLAG_ALIVE : 0) |
+                    (worm->speed_boost_active ? WORM_FLAG_BOOST : 0) |
+                    (worm->is_ghost ? WORM_FLAG_GHOST : 0);
+    for (int j = 0; j < MAX_BULLETS; j++) {
+      if (worm->bullets[j].active) {
+        flags |= 1 << (WORM_FLAG_BULLET_SHIFT + j);
+      }
+    }
+    put_u8(&writer, flags);
+    put_coord(&writer, worm->position.x);
+    put_coord(&writer, worm->position.y);
+    put_angle(&writer, worm->angle);
+    put_u8(&writer, worm->bullets_left);
+    put_duration(&writer, worm->speed_boost_time_left);
+    put_varint(&writer, worm->input_seq);
+
+    for (int j = 0; j < MAX_BULLETS; j++) {
+      if (worm->bullets[j].active) {
+        put_coord(&writer, worm->bullets[j].position.x);
+        put_coord(&writer, worm->bullets[j].position.y);
+        put_angle(&writer, worm->bullets[j].angle);
+      }
+    }
+
+    int path_start = path_starts[i];
+    put_varint(&writer, worm->path_length);
+    put_varint(&writer, path_start);
+    for (int j = path_start; j < worm->path_length; j++) {
+      put_coord(&writer, worm->points[j - worm->path_base].x);
+      put_coord(&writer, worm->points[j - worm->path_base].y);
+    }
+  }
+
+  if (writer.overflow) {
+    log_warn("State message truncated");
+  }
+  return writer.offset;
+}
+
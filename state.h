@@ -0,0 +1,41 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include "sim.h"
+
+#include <stddef.h>
+
+// A worm as it was at the end of one tick. Only the tail of the path that
+// some recipient still needs is copied: points[j] is path[path_base + j].
+typedef struct {
+  Point position;
+  float angle;
+  bool alive;
+  int bullets_left;
+  Bullet bullets[MAX_BULLETS];
+  float speed_boost_time_left;
+  bool speed_boost_active;
+  bool is_ghost;
+  uint32_t input_seq; // Sequence of the client INPUT this tick applied
+  int path_length;
+  int path_base;
+  Point *points;
+} WormSnapshot;
+
+// What one STATE message describes, independent of who receives it
+typedef struct {
+  unsigned int seq;
+  int num_worms;
+  WormSnapshot worms[SIM_MAX_WORMS];
+  int num_powerups;
+  Powerup powerups[MAX_POWERUPS];
+} WorldState;
+
+// Encode a STATE (layout in protocol.h) for a recipient that needs worm i's
+// path from path_starts[i] onwards. Both return the message length.
+int build_text_state(const WorldState *world, char *state, size_t size,
+                     const int *path_starts);
+int build_binary_state(const WorldState *world, char *state, size_t size,
+                       const int *path_starts);
+
+#endif
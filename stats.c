@@ -0,0 +1,102 @@
+#include "stats.h"
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+static int bucket_index(uint64_t value) {
+  if (value < SUB_BUCKETS) {
+    return value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  int shift = exponent - HISTOGRAM_SUB_BITS;
+  int index = (shift + 1) * SUB_BUCKETS + (int)((value >> shift) - SUB_BUCKETS);
+  return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// Largest value that lands in bucket index
+static uint64_t bucket_upper_bound(int index) {
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+  int shift = index / SUB_BUCKETS - 1;
+  uint64_t lower = (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+  return lower + ((uint64_t)1 << shift) - 1;
+}
+
+void histogram_init(Histogram *histogram) {
+  for (int w = 0; w < HISTOGRAM_WINDOWS; w++) {
+    HistogramWindow *window = &histogram->windows[w];
+    atomic_init(&window->window, -1);
+    atomic_init(&window->max, 0);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      atomic_init(&window->counts[i], 0);
+    }
+  }
+}
+
+// Only the recording thread writes, so plain loads and stores suffice; they
+// are atomic so collectors never see a torn count.
+void histogram_record(Histogram *histogram, int64_t now_ns, uint64_t value) {
+  int64_t current = now_ns / HISTOGRAM_WINDOW_NS;
+  HistogramWindow *window =
+      &histogram->windows[current % HISTOGRAM_WINDOWS];
+  if (atomic_load_explicit(&window->window, memory_order_relaxed) != current) {
+    // Recycle the slot of the window HISTOGRAM_WINDOWS seconds ago
+    atomic_store_explicit(&window->window, -1, memory_order_relaxed);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      atomic_store_explicit(&window->counts[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&window->max, 0, memory_order_relaxed);
+    atomic_store_explicit(&window->window, current, memory_order_release);
+  }
+
+  _Atomic uint32_t *count = &window->counts[bucket_index(value)];
+  atomic_store_explicit(
+      count, atomic_load_explicit(count, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+  if (value > atomic_load_explicit(&window->max, memory_order_relaxed)) {
+    atomic_store_explicit(&window->max, value, memory_order_relaxed);
+  }
+}
+
+void histogram_collect(const Histogram *histogram, int64_t now_ns,
+                       HistogramTotals *totals) {
+  int64_t current = now_ns / HISTOGRAM_WINDOW_NS;
+  for (int w = 0; w < HISTOGRAM_WINDOWS; w++) {
+    const HistogramWindow *window = &histogram->windows[w];
+    int64_t recorded = atomic_load_explicit(
+        (_Atomic int64_t *)&window->window, memory_order_acquire);
+    if (recorded < 0 || current - recorded >= HISTOGRAM_WINDOWS) {
+      continue;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      uint32_t count = atomic_load_explicit(
+          (_Atomic uint32_t *)&window->counts[i], memory_order_relaxed);
+      totals->counts[i] += count;
+      totals->count += count;
+    }
+    uint64_t max = atomic_load_explicit((_Atomic uint64_t *)&window->max,
+                                        memory_order_relaxed);
+    if (max > totals->max) {
+      totals->max = max;
+    }
+  }
+}
+
+uint64_t histogram_quantile(const HistogramTotals *totals, double q) {
+  if (totals->count == 0) {
+    return 0;
+  }
+  uint64_t rank = q * totals->count;
+  if (rank >= totals->count) {
+    rank = totals->count - 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += totals->counts[i];
+    if (seen > rank) {
+      uint64_t value = bucket_upper_bound(i);
+      return value < totals->max ? value : totals->max;
+    }
+  }
+  return totals->max;
+}
@@ -0,0 +1,46 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Rolling log-linear histograms in the style of HdrHistogram: values below
+// 2^HISTOGRAM_SUB_BITS get a bucket each, and every power of two above that
+// is split into 2^HISTOGRAM_SUB_BITS buckets, so a recorded value is known to
+// within about 6%. Counts are kept per one-second window, and only the last
+// HISTOGRAM_WINDOWS windows are reported.
+//
+// One thread records into a histogram; any thread may collect from it at the
+// same time, at worst seeing a window that is being cleared.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS 640 // Values below 2^43; larger ones are clamped
+#define HISTOGRAM_WINDOWS 10
+#define HISTOGRAM_WINDOW_NS 1000000000LL
+
+typedef struct {
+  _Atomic int64_t window; // now_ns / HISTOGRAM_WINDOW_NS, -1 for unused
+  _Atomic uint64_t max;
+  _Atomic uint32_t counts[HISTOGRAM_BUCKETS];
+} HistogramWindow;
+
+typedef struct {
+  HistogramWindow windows[HISTOGRAM_WINDOWS];
+} Histogram;
+
+// Several histograms' recent windows merged, for reporting
+typedef struct {
+  uint64_t count;
+  uint64_t max;
+  uint64_t counts[HISTOGRAM_BUCKETS];
+} HistogramTotals;
+
+void histogram_init(Histogram *histogram);
+void histogram_record(Histogram *histogram, int64_t now_ns, uint64_t value);
+// Adds the windows recorded within HISTOGRAM_WINDOWS of now_ns to totals
+void histogram_collect(const Histogram *histogram, int64_t now_ns,
+                       HistogramTotals *totals);
+// The value at quantile q (0 to 1): the upper bound of its bucket, capped at
+// the exact maximum. 0 when nothing was recorded.
+uint64_t histogram_quantile(const HistogramTotals *totals, double q);
+
+#endif